@@ -5,22 +5,46 @@
  * SPDX-License-Identifer: LGPL-3.0-or-later
  */
 
+#include <dirent.h>
 #include <dlfcn.h>
 #include <errno.h>
 #include <error.h>
+#include <fcntl.h>
+#include <fnmatch.h>
 #include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_MONGOC
+# include <mongoc/mongoc.h>
+#endif
 
 #include <robinhood.h>
+#include <robinhood/sstack.h>
+#include <robinhood/uri.h>
 #include <robinhood/utils.h>
 
 #ifndef RBH_ITER_CHUNK_SIZE
 # define RBH_ITER_CHUNK_SIZE (1 << 12)
 #endif
 
+#ifdef HAVE_MONGOC
+/* The mongo backend always connects to this deployment */
+# ifndef RBH_MONGO_URI
+#  define RBH_MONGO_URI "mongodb://localhost:27017"
+# endif
+#endif
+
 static struct rbh_backend *from, *to;
 
 static void __attribute__((destructor))
@@ -37,16 +61,41 @@ destroy_to(void)
         rbh_backend_destroy(to);
 }
 
-static struct rbh_mut_iterator *chunks;
+static bool one = false;
+static size_t jobs = 1;
+
+#ifdef HAVE_MONGOC
+static mongoc_client_t *client;
 
+/* mongoc_cleanup() is left to librobinhood's mongo backend, which requires
+ * every client to be destroyed first: main() destroys this one as soon as it is
+ * done with it, this destructor only covers early exits.
+ */
 static void __attribute__((destructor))
-destroy_chunks(void)
+destroy_client(void)
 {
-    if (chunks)
-        rbh_mut_iter_destroy(chunks);
+    if (client) {
+        mongoc_client_destroy(client);
+        client = NULL;
+    }
 }
 
-static bool one = false;
+/* A client for rbh-sync's own requests to the mongo deployment */
+static mongoc_client_t *
+mongo_client(void)
+{
+    if (client)
+        return client;
+
+    mongoc_init();
+    client = mongoc_client_new(RBH_MONGO_URI);
+    if (client == NULL)
+        error(EXIT_FAILURE, 0, "mongoc_client_new: invalid URI: %s",
+              RBH_MONGO_URI);
+
+    return client;
+}
+#endif
 
 /*----------------------------------------------------------------------------*
  |                                   sync()                                   |
@@ -110,362 +159,4549 @@ mut_iter_one(void *element)
 }
 
     /*--------------------------------------------------------------------*
-     |                           iter_convert()                           |
+     |                            xattr policy                            |
      *--------------------------------------------------------------------*/
 
-/* A convert_iterator converts fsentries into fsevents.
+/* A few xattrs (layouts, HSM or link EAs, ...) hold values of several
+ * kilobytes, which bloat both the bulk operations sent to DEST and DEST itself.
  *
- * For each fsentry, it yields up to two fsevents (depending on the information
- * available in the fsentry): one RBH_FET_UPSERT, to create the inode in the
- * backend; and one RBH_FET_LINK to "link" the inode in the namespace.
+ * An xattr policy caps the size of string and binary values. Values above the
+ * cap are either dropped, truncated, or replaced with a map of their hash and
+ * size:
+ *
+ *     { "fnv1a": <64 bit FNV-1a hash>, "size": <size of the value> }
+ *
+ * Rules can target xattrs by name (with shell wildcards), the first one that
+ * matches applies. Other xattrs follow the default rule, which is not to cap
+ * anything.
  */
-struct convert_iterator {
-    struct rbh_iterator iterator;
-    struct rbh_iterator *fsentries;
 
-    const struct rbh_filter_projection *projection;
-    const struct rbh_fsentry *fsentry;
-    struct rbh_fsevent fsevent;
-    struct rbh_statx statx;
-    struct {
-        bool upsert:1;
-        bool inode_xattr:1;
-        bool link:1;
-        bool ns_xattr:1;
-    } todo;
+/* Size of the scratch memory used to rewrite an fsentry's xattrs */
+#ifndef RBH_XATTR_SCRATCH_SIZE
+# define RBH_XATTR_SCRATCH_SIZE (1 << 16)
+#endif
+
+enum xattr_action {
+    XA_DROP,
+    XA_TRUNCATE,
+    XA_HASH,
+    XA_COUNT,
 };
 
-/* Advance a convert_iterator to its next fsentry */
-static int
-_convert_iter_next(struct convert_iterator *convert,
-                   const struct rbh_filter_projection *projection)
+static const char *const XATTR_ACTIONS[] = {
+    [XA_DROP]       = "drop",
+    [XA_TRUNCATE]   = "truncate",
+    [XA_HASH]       = "hash",
+};
+
+struct xattr_rule {
+    const char *pattern;
+    size_t max_size;
+    enum xattr_action action;
+};
+
+static struct {
+    struct xattr_rule fallback;
+    struct xattr_rule *rules;
+    size_t count;
+
+    /* Number of entries, and values per action, the policy applied to */
+    size_t entries;
+    size_t values[XA_COUNT];
+} xattr_policy = {
+    .fallback = {
+        .max_size = SIZE_MAX,
+        .action = XA_DROP,
+    },
+};
+
+/* Print what the policy applied to, once the sync is over */
+static void
+xattr_policy_report(void)
 {
-    const struct rbh_fsentry *fsentry;
-    bool upsert, inode_xattr, link, ns_xattr;
+    if (xattr_policy.entries == 0)
+        return;
 
-    do {
-        struct {
-            bool id:1;
-            bool parent_id:1;
-            bool name:1;
-            bool inode_xattrs:1;
-            bool ns_xattrs:1;
-        } has, needs = {
-            .id = projection->fsentry_mask & RBH_FP_ID,
-            .parent_id = projection->fsentry_mask & RBH_FP_PARENT_ID,
-            .name = projection->fsentry_mask & RBH_FP_NAME,
-            .inode_xattrs = projection->fsentry_mask & RBH_FP_INODE_XATTRS,
-            .ns_xattrs = projection->fsentry_mask & RBH_FP_NAMESPACE_XATTRS,
-        };
+    error(0, 0, "xattr policy applied to %zu entries (%zu values dropped, "
+                "%zu truncated, %zu hashed)", xattr_policy.entries,
+          xattr_policy.values[XA_DROP], xattr_policy.values[XA_TRUNCATE],
+          xattr_policy.values[XA_HASH]);
+}
 
-next:
-        fsentry = rbh_iter_next(convert->fsentries);
-        if (fsentry == NULL)
-            return -1;
+static void __attribute__((destructor))
+destroy_xattr_policy(void)
+{
+    free(xattr_policy.rules);
+}
 
-        has.id = fsentry->mask & RBH_FP_ID;
-        has.parent_id = fsentry->mask & RBH_FP_PARENT_ID;
-        has.name = fsentry->mask & RBH_FP_NAME;
-        has.inode_xattrs = fsentry->mask & RBH_FP_INODE_XATTRS
-                        && fsentry->xattrs.inode.count;
-        has.ns_xattrs = fsentry->mask & RBH_FP_NAMESPACE_XATTRS
-                     && fsentry->xattrs.ns.count;
+static bool
+xattr_policy_enabled(void)
+{
+    return xattr_policy.count > 0 || xattr_policy.fallback.max_size != SIZE_MAX;
+}
 
-        if (!has.id)
-            goto next;
+/* The size of the largest truncated value */
+static size_t
+xattr_policy_max_truncation(void)
+{
+    size_t max = 0;
 
-        /* What kind of fsevent should this fsentry be converted into? */
-        upsert = needs.id;
-        inode_xattr = !upsert && needs.inode_xattrs && has.inode_xattrs;
-        link = needs.parent_id && needs.name && has.parent_id && has.name;
-        ns_xattr = !link && has.parent_id && has.name && needs.ns_xattrs
-                && has.ns_xattrs && fsentry->xattrs.ns.count;
-    } while (!(upsert || inode_xattr || link || ns_xattr));
-
-    convert->fsentry = fsentry;
-    convert->todo.upsert = upsert;
-    convert->todo.inode_xattr = inode_xattr;
-    convert->todo.link = link;
-    convert->todo.ns_xattr = ns_xattr;
-    return 0;
+    for (size_t i = 0; i < xattr_policy.count; i++) {
+        const struct xattr_rule *rule = &xattr_policy.rules[i];
+
+        if (rule->action == XA_TRUNCATE && rule->max_size > max)
+            max = rule->max_size;
+    }
+
+    if (xattr_policy.fallback.action == XA_TRUNCATE
+     && xattr_policy.fallback.max_size > max)
+        max = xattr_policy.fallback.max_size;
+
+    return max;
 }
 
-static struct rbh_statx *
-statx_project(struct rbh_statx *dest, const struct rbh_statx *source,
-              uint64_t mask)
+static const struct xattr_rule *
+xattr_rule(const char *name)
 {
-    *dest = *source;
-    dest->stx_mask &= mask;
-    return dest;
+    for (size_t i = 0; i < xattr_policy.count; i++) {
+        if (fnmatch(xattr_policy.rules[i].pattern, name, 0) == 0)
+            return &xattr_policy.rules[i];
+    }
+    return &xattr_policy.fallback;
 }
 
-static struct rbh_fsevent *
-upsert_from_fsentry(struct rbh_fsevent *fsevent, struct rbh_statx *statx,
-                    const struct rbh_fsentry *fsentry,
-                    const struct rbh_filter_projection *projection)
+/* FNV-1a */
+static uint64_t
+hash_bytes(const void *data, size_t size)
+{
+    const unsigned char *bytes = data;
+    uint64_t hash = 0xcbf29ce484222325;
+
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+/* Memory to rewrite an fsentry's xattrs in.
+ *
+ * Allocations are served by an sstack, unless they are larger than what it can
+ * hold (eg. the pairs of a map with thousands of xattrs), which are malloc'ed
+ * and freed by scratch_clear().
+ */
+struct scratch {
+    struct rbh_sstack *sstack;
+    size_t size;
+
+    void **blocks;
+    size_t count;
+    size_t capacity;
+};
+
+static struct scratch *
+scratch_new(void)
+{
+    size_t size = xattr_policy_max_truncation() + 1;
+    struct scratch *scratch;
+
+    scratch = malloc(sizeof(*scratch));
+    if (scratch == NULL)
+        error(EXIT_FAILURE, errno, "malloc");
+
+    scratch->size = size > RBH_XATTR_SCRATCH_SIZE ? size
+                                                  : RBH_XATTR_SCRATCH_SIZE;
+    scratch->sstack = rbh_sstack_new(scratch->size);
+    if (scratch->sstack == NULL)
+        error(EXIT_FAILURE, errno, "rbh_sstack_new");
+    scratch->blocks = NULL;
+    scratch->count = 0;
+    scratch->capacity = 0;
+    return scratch;
+}
+
+static void *
+scratch_push_block(struct scratch *scratch, const void *data, size_t size)
+{
+    void *block;
+
+    if (scratch->count == scratch->capacity) {
+        size_t capacity = scratch->capacity ? 2 * scratch->capacity : 4;
+        void **blocks;
+
+        blocks = reallocarray(scratch->blocks, capacity, sizeof(*blocks));
+        if (blocks == NULL)
+            error(EXIT_FAILURE, errno, "reallocarray");
+        scratch->blocks = blocks;
+        scratch->capacity = capacity;
+    }
+
+    block = malloc(size);
+    if (block == NULL)
+        error(EXIT_FAILURE, errno, "malloc");
+    if (data)
+        memcpy(block, data, size);
+
+    scratch->blocks[scratch->count++] = block;
+    return block;
+}
+
+static void *
+scratch_push(struct scratch *scratch, const void *data, size_t size)
+{
+    void *pointer;
+
+    if (size > scratch->size)
+        return scratch_push_block(scratch, data, size);
+
+    pointer = rbh_sstack_push(scratch->sstack, data, size);
+    if (pointer == NULL)
+        error(EXIT_FAILURE, errno, "rbh_sstack_push");
+    return pointer;
+}
+
+static void
+scratch_clear(struct scratch *scratch)
+{
+    size_t readable;
+
+    while (rbh_sstack_peek(scratch->sstack, &readable), readable > 0)
+        rbh_sstack_pop(scratch->sstack, readable);
+
+    while (scratch->count > 0)
+        free(scratch->blocks[--scratch->count]);
+}
+
+static void
+scratch_destroy(struct scratch *scratch)
+{
+    scratch_clear(scratch);
+    free(scratch->blocks);
+    rbh_sstack_destroy(scratch->sstack);
+    free(scratch);
+}
+
+/* The size of `value' (if the policy applies to it) */
+static size_t
+value_size(const struct rbh_value *value)
+{
+    if (value == NULL)
+        return 0;
+
+    switch (value->type) {
+    case RBH_VT_BINARY:
+        return value->binary.size;
+    case RBH_VT_STRING:
+        return strlen(value->string);
+    default:
+        return 0;
+    }
+}
+
+static const struct rbh_value *
+value_truncate(const struct rbh_value *value, size_t size,
+               struct scratch *scratch)
+{
+    struct rbh_value *truncated;
+    char *string;
+
+    truncated = scratch_push(scratch, value, sizeof(*value));
+    switch (value->type) {
+    case RBH_VT_BINARY:
+        truncated->binary.size = size;
+        break;
+    case RBH_VT_STRING:
+        /* Do not split a UTF-8 sequence */
+        while (size > 0 && (value->string[size] & 0xc0) == 0x80)
+            size--;
+        string = scratch_push(scratch, value->string, size + 1);
+        string[size] = '\0';
+        truncated->string = string;
+        break;
+    default:
+        __builtin_unreachable();
+    }
+    return truncated;
+}
+
+static const struct rbh_value *
+value_hash(const struct rbh_value *value, size_t size,
+           struct scratch *scratch)
+{
+    const void *data = value->type == RBH_VT_BINARY ? value->binary.data
+                                                    : value->string;
+    struct rbh_value_pair *pairs;
+    struct rbh_value *values;
+    struct rbh_value *map;
+
+    values = scratch_push(scratch, NULL, 2 * sizeof(*values));
+    values[0].type = RBH_VT_UINT64;
+    values[0].uint64 = hash_bytes(data, size);
+    values[1].type = RBH_VT_UINT64;
+    values[1].uint64 = size;
+
+    pairs = scratch_push(scratch, NULL, 2 * sizeof(*pairs));
+    pairs[0].key = "fnv1a";
+    pairs[0].value = &values[0];
+    pairs[1].key = "size";
+    pairs[1].value = &values[1];
+
+    map = scratch_push(scratch, NULL, sizeof(*map));
+    map->type = RBH_VT_MAP;
+    map->map.pairs = pairs;
+    map->map.count = 2;
+    return map;
+}
+
+/* Apply the xattr policy to `map', rewritten pairs are allocated in `scratch'.
+ *
+ * Dropped values are replaced with NULL, so that DEST removes whatever value it
+ * has for them, unless `omit_dropped' is set (for documents inserted as a
+ * whole, where the pair is simply left out).
+ *
+ * Returns the number of values the policy applied to.
+ */
+static size_t
+xattr_policy_apply(struct rbh_value_map *map, struct scratch *scratch,
+                   bool omit_dropped)
+{
+    struct rbh_value_pair *pairs = NULL;
+    size_t applied = 0;
+    size_t count = 0;
+
+    for (size_t i = 0; i < map->count; i++) {
+        const struct rbh_value_pair *pair = &map->pairs[i];
+        size_t size = value_size(pair->value);
+        const struct xattr_rule *rule;
+
+        rule = size ? xattr_rule(pair->key) : &xattr_policy.fallback;
+        if (size <= rule->max_size) {
+            if (pairs)
+                pairs[count++] = *pair;
+            continue;
+        }
+
+        if (pairs == NULL) {
+            pairs = scratch_push(scratch, map->pairs,
+                                 map->count * sizeof(*pairs));
+            count = i;
+        }
+
+        switch (rule->action) {
+        case XA_DROP:
+            if (omit_dropped)
+                break;
+            pairs[count].key = pair->key;
+            pairs[count++].value = NULL;
+            break;
+        case XA_TRUNCATE:
+            pairs[count].key = pair->key;
+            pairs[count++].value = value_truncate(pair->value, rule->max_size,
+                                                  scratch);
+            break;
+        case XA_HASH:
+            pairs[count].key = pair->key;
+            pairs[count++].value = value_hash(pair->value, size, scratch);
+            break;
+        case XA_COUNT:
+            __builtin_unreachable();
+        }
+        __atomic_add_fetch(&xattr_policy.values[rule->action], 1,
+                           __ATOMIC_RELAXED);
+        applied++;
+    }
+
+    if (pairs) {
+        map->pairs = pairs;
+        map->count = count;
+    }
+    return applied;
+}
+
+static void
+xattr_policy_count_entry(void)
 {
+    __atomic_add_fetch(&xattr_policy.entries, 1, __ATOMIC_RELAXED);
+}
+
+    /*--------------------------------------------------------------------*
+     |                          convert_batch()                           |
+     *--------------------------------------------------------------------*/
+
+/* Each fsentry is converted into up to two fsevents (depending on the
+ * information available in the fsentry): one RBH_FET_UPSERT, to create the
+ * inode in the backend (or an RBH_FET_XATTR if only its xattrs are to be
+ * synced); and one RBH_FET_LINK to "link" the inode in the namespace (or an
+ * RBH_FET_XATTR for its namespace xattrs).
+ *
+ * Fsentries are converted in batches, by a kernel which writes fsevents into a
+ * contiguous array, without allocating memory.
+ */
+
+/* Number of fsentries converted at once */
+#ifndef RBH_CONVERT_BATCH_SIZE
+# define RBH_CONVERT_BATCH_SIZE (1 << 8)
+#endif
+
+#define FSEVENTS_PER_FSENTRY 2
+
+/* What a projection requires from fsentries, computed once per conversion */
+struct convert_plan {
+    uint32_t statx_mask;
     struct {
-        bool xattrs:1;
+        bool upsert:1;
+        bool inode_xattrs:1;
+        bool link:1;
+        bool ns_xattrs:1;
         bool statx:1;
         bool symlink:1;
-    } has = {
-        .xattrs = fsentry->mask & RBH_FP_INODE_XATTRS,
-        .statx = fsentry->mask & RBH_FP_STATX,
-        .symlink = fsentry->mask & RBH_FP_SYMLINK,
-    }, needs = {
-        .xattrs = projection->fsentry_mask & RBH_FP_INODE_XATTRS,
-        .statx = projection->fsentry_mask & RBH_FP_STATX,
-        .symlink = projection->fsentry_mask & RBH_FP_SYMLINK,
-    };
+    } needs;
+};
+
+static void
+convert_plan_init(struct convert_plan *plan,
+                  const struct rbh_filter_projection *projection)
+{
+    const uint32_t mask = projection->fsentry_mask;
 
+    plan->statx_mask = projection->statx_mask;
+    plan->needs.upsert = mask & RBH_FP_ID;
+    plan->needs.inode_xattrs = mask & RBH_FP_INODE_XATTRS;
+    plan->needs.link = (mask & RBH_FP_PARENT_ID) && (mask & RBH_FP_NAME);
+    plan->needs.ns_xattrs = mask & RBH_FP_NAMESPACE_XATTRS;
+    plan->needs.statx = mask & RBH_FP_STATX;
+    plan->needs.symlink = mask & RBH_FP_SYMLINK;
+}
+
+/* Only copy `statx' if some of its fields must be masked out */
+static const struct rbh_statx *
+statx_project(struct rbh_statx *buffer, const struct rbh_statx *statx,
+              uint32_t mask)
+{
+    if ((statx->stx_mask & ~mask) == 0)
+        return statx;
+
+    *buffer = *statx;
+    buffer->stx_mask &= mask;
+    return buffer;
+}
+
+static void
+upsert_from_fsentry(struct rbh_fsevent *fsevent, struct rbh_statx *statx,
+                    const struct rbh_fsentry *fsentry,
+                    const struct convert_plan *plan)
+{
     fsevent->type = RBH_FET_UPSERT;
-    assert(fsentry->mask & RBH_FP_ID);
     fsevent->id = fsentry->id;
 
-    if (needs.xattrs & has.xattrs)
+    if (plan->needs.inode_xattrs && (fsentry->mask & RBH_FP_INODE_XATTRS))
         fsevent->xattrs = fsentry->xattrs.inode;
     else
         fsevent->xattrs.count = 0;
 
-    if (needs.statx & has.statx)
-        fsevent->upsert.statx = statx_project(statx, fsentry->statx,
-                                              projection->statx_mask);
-    else
-        fsevent->upsert.statx = NULL;
+    if (plan->needs.statx && (fsentry->mask & RBH_FP_STATX))
+        fsevent->upsert.statx = statx_project(statx, fsentry->statx,
+                                              plan->statx_mask);
+    else
+        fsevent->upsert.statx = NULL;
+
+    if (plan->needs.symlink && (fsentry->mask & RBH_FP_SYMLINK))
+        fsevent->upsert.symlink = fsentry->symlink;
+    else
+        fsevent->upsert.symlink = NULL;
+}
+
+static void
+inode_xattr_from_fsentry(struct rbh_fsevent *fsevent,
+                         const struct rbh_fsentry *fsentry)
+{
+    fsevent->type = RBH_FET_XATTR;
+    fsevent->id = fsentry->id;
+    fsevent->xattrs = fsentry->xattrs.inode;
+    fsevent->ns.parent_id = NULL;
+    fsevent->ns.name = NULL;
+}
+
+static void
+link_from_fsentry(struct rbh_fsevent *fsevent,
+                  const struct rbh_fsentry *fsentry,
+                  const struct convert_plan *plan)
+{
+    fsevent->type = RBH_FET_LINK;
+    fsevent->id = fsentry->id;
+    fsevent->link.parent_id = &fsentry->parent_id;
+    fsevent->link.name = fsentry->name;
+
+    if (plan->needs.ns_xattrs && (fsentry->mask & RBH_FP_NAMESPACE_XATTRS))
+        fsevent->xattrs = fsentry->xattrs.ns;
+    else
+        fsevent->xattrs.count = 0;
+}
+
+static void
+ns_xattr_from_fsentry(struct rbh_fsevent *fsevent,
+                      const struct rbh_fsentry *fsentry)
+{
+    fsevent->type = RBH_FET_XATTR;
+    fsevent->id = fsentry->id;
+    fsevent->ns.parent_id = &fsentry->parent_id;
+    fsevent->ns.name = fsentry->name;
+    fsevent->xattrs = fsentry->xattrs.ns;
+}
+
+/* Convert `count' fsentries into at most `FSEVENTS_PER_FSENTRY * count'
+ * fsevents, stored in `fsevents'.
+ *
+ * `statxs' must hold `count' elements, it is used for the statx fields that
+ * need masking. If `scratch' is not NULL, the xattr policy is applied to the
+ * fsevents, with `scratch' holding the xattrs it rewrites.
+ *
+ * Returns the number of fsevents stored in `fsevents'.
+ */
+static size_t
+convert_batch(const struct convert_plan *plan,
+              const struct rbh_fsentry *const *fsentries, size_t count,
+              struct rbh_fsevent *fsevents, struct rbh_statx *statxs,
+              struct scratch *scratch)
+{
+    struct rbh_fsevent *fsevent = fsevents;
+
+    for (size_t i = 0; i < count; i++) {
+        const struct rbh_fsentry *fsentry = fsentries[i];
+        const uint32_t mask = fsentry->mask;
+        struct rbh_fsevent *first = fsevent;
+        size_t applied = 0;
+        bool linked;
+
+        if (!(mask & RBH_FP_ID))
+            continue;
+
+        linked = (mask & RBH_FP_PARENT_ID) && (mask & RBH_FP_NAME);
+
+        /* What kind of fsevent should this fsentry be converted into? */
+        if (plan->needs.upsert)
+            upsert_from_fsentry(fsevent++, &statxs[i], fsentry, plan);
+        else if (plan->needs.inode_xattrs && (mask & RBH_FP_INODE_XATTRS)
+              && fsentry->xattrs.inode.count)
+            inode_xattr_from_fsentry(fsevent++, fsentry);
+
+        if (plan->needs.link && linked)
+            link_from_fsentry(fsevent++, fsentry, plan);
+        else if (plan->needs.ns_xattrs && linked
+              && (mask & RBH_FP_NAMESPACE_XATTRS) && fsentry->xattrs.ns.count)
+            ns_xattr_from_fsentry(fsevent++, fsentry);
+
+        if (scratch == NULL)
+            continue;
+
+        for (struct rbh_fsevent *event = first; event < fsevent; event++)
+            applied += xattr_policy_apply(&event->xattrs, scratch, false);
+        if (applied)
+            xattr_policy_count_entry();
+    }
+
+    return fsevent - fsevents;
+}
+
+    /*--------------------------------------------------------------------*
+     |                           iter_convert()                           |
+     *--------------------------------------------------------------------*/
+
+/* A convert_iterator converts fsentries into fsevents, a batch at a time */
+struct convert_iterator {
+    struct rbh_iterator iterator;
+    struct rbh_mut_iterator *fsentries;
+
+    struct convert_plan plan;
+    /* Only set when there is an xattr policy to apply */
+    struct scratch *scratch;
+
+    struct rbh_fsentry *batch[RBH_CONVERT_BATCH_SIZE];
+    size_t batch_size;
+    struct rbh_statx statxs[RBH_CONVERT_BATCH_SIZE];
+    struct rbh_fsevent fsevents[FSEVENTS_PER_FSENTRY * RBH_CONVERT_BATCH_SIZE];
+    size_t count;
+    size_t index;
+};
+
+static void
+convert_iter_release(struct convert_iterator *convert)
+{
+    for (size_t i = 0; i < convert->batch_size; i++)
+        free(convert->batch[i]);
+    convert->batch_size = 0;
+
+    if (convert->scratch)
+        scratch_clear(convert->scratch);
+}
+
+/* Read and convert the next batch of fsentries */
+static int
+convert_iter_fill(struct convert_iterator *convert)
+{
+    convert_iter_release(convert);
+
+    while (convert->batch_size < RBH_CONVERT_BATCH_SIZE) {
+        struct rbh_fsentry *fsentry = rbh_mut_iter_next(convert->fsentries);
+
+        if (fsentry == NULL) {
+            if (errno != ENODATA || convert->batch_size == 0)
+                return -1;
+            break;
+        }
+        convert->batch[convert->batch_size++] = fsentry;
+    }
+
+    convert->count = convert_batch(&convert->plan,
+                                   (const struct rbh_fsentry **)convert->batch,
+                                   convert->batch_size, convert->fsevents,
+                                   convert->statxs, convert->scratch);
+    convert->index = 0;
+    return 0;
+}
+
+static const void *
+convert_iter_next(void *iterator)
+{
+    struct convert_iterator *convert = iterator;
+
+    /* A batch may not yield a single fsevent */
+    while (convert->index == convert->count) {
+        if (convert_iter_fill(convert))
+            return NULL;
+    }
+
+    return &convert->fsevents[convert->index++];
+}
+
+static void
+convert_iter_destroy(void *iterator) {
+    struct convert_iterator *convert = iterator;
+
+    convert_iter_release(convert);
+    rbh_mut_iter_destroy(convert->fsentries);
+    if (convert->scratch)
+        scratch_destroy(convert->scratch);
+    free(convert);
+}
+
+static const struct rbh_iterator_operations CONVERT_ITER_OPS = {
+    .next = convert_iter_next,
+    .destroy = convert_iter_destroy,
+};
+
+static const struct rbh_iterator CONVERT_ITER = {
+    .ops = &CONVERT_ITER_OPS,
+};
+
+/* Takes ownership of `fsentries' */
+static struct rbh_iterator *
+iter_convert(struct rbh_mut_iterator *fsentries,
+             const struct rbh_filter_projection *projection)
+{
+    struct convert_iterator *convert;
+
+    convert = malloc(sizeof(*convert));
+    if (convert == NULL)
+        return NULL;
+
+    convert->iterator = CONVERT_ITER;
+    convert->fsentries = fsentries;
+    convert_plan_init(&convert->plan, projection);
+    convert->scratch = xattr_policy_enabled() ? scratch_new() : NULL;
+    convert->batch_size = 0;
+    convert->count = 0;
+    convert->index = 0;
+
+    return &convert->iterator;
+}
+
+    /*--------------------------------------------------------------------*
+     |                          fsevent streams                           |
+     *--------------------------------------------------------------------*/
+
+/* With "-" as DEST, rbh-sync writes the fsevents it would have applied to DEST
+ * on its standard output. With "-" as SOURCE, it reads such fsevents on its
+ * standard input and applies them to DEST. Scanning and ingesting can then run
+ * in different processes, connected by a pipe:
+ *
+ *     rbh-sync rbh:lustre:/mnt/lustre - | rbh-sync - rbh:mongo:lustre
+ *
+ * A stream starts with STREAM_MAGIC and a 32 bit version. Each fsevent is then
+ * sent in a frame:
+ *
+ *     SIZE VALUES TYPE ID XATTRS ...
+ *
+ * where SIZE is the number of bytes after VALUES, and VALUES the number of
+ * rbh_value(s) and rbh_value_pair(s) required to decode the frame. What
+ * follows XATTRS depends on TYPE:
+ *
+ *     RBH_FET_UPSERT                  FLAGS [STATX] [SYMLINK]
+ *     RBH_FET_{LINK,UNLINK,XATTR}     FLAGS [PARENT-ID] [NAME]
+ *     RBH_FET_DELETE                  (nothing)
+ *
+ * A frame whose SIZE is 0 ends the stream, which tells a complete stream from
+ * one whose writer died.
+ *
+ * Types are librobinhood's own enum values, and integers are little-endian.
+ * Ids, strings and binary values are prefixed with their size (strings include
+ * their terminating null byte, so that readers can use them in place). Values
+ * are a byte for their type followed by their content, maps and sequences are
+ * prefixed with their number of elements. Statx are their mask followed by the
+ * fields it selects, in STATX_MEMBERS' order.
+ */
+
+#define STREAM_MAGIC "rbh-sync"
+#define STREAM_MAGIC_SIZE (sizeof(STREAM_MAGIC) - 1)
+#define STREAM_VERSION 1
+
+/* Size of the stdio buffer of streams */
+#ifndef RBH_STREAM_BUFFER_SIZE
+# define RBH_STREAM_BUFFER_SIZE (1 << 16)
+#endif
+
+/* Capacity requested for pipes (Linux grants up to /proc/sys/fs/pipe-max-size,
+ * 1 MiB by default), the more a pipe holds, the less the writer and the reader
+ * have to wait for one another.
+ */
+#ifndef RBH_STREAM_PIPE_SIZE
+# define RBH_STREAM_PIPE_SIZE (1 << 20)
+#endif
+
+enum stream_flag {
+    SF_STATX        = 0x1,
+    SF_SYMLINK      = 0x2,
+    SF_PARENT_ID    = 0x4,
+    SF_NAME         = 0x8,
+};
+
+/* The type of missing values (ie. xattrs to remove) */
+#define STREAM_VT_NONE 0xff
+
+static const struct statx_member {
+    uint32_t mask;
+    size_t offset;
+    size_t size;
+} STATX_MEMBERS[] = {
+#define STATX_MEMBER(mask, member) \
+    { mask, offsetof(struct rbh_statx, member), \
+      sizeof(((struct rbh_statx *)NULL)->member) }
+    STATX_MEMBER(RBH_STATX_TYPE | RBH_STATX_MODE, stx_mode),
+    STATX_MEMBER(RBH_STATX_NLINK, stx_nlink),
+    STATX_MEMBER(RBH_STATX_UID, stx_uid),
+    STATX_MEMBER(RBH_STATX_GID, stx_gid),
+    STATX_MEMBER(RBH_STATX_ATIME_SEC, stx_atime.tv_sec),
+    STATX_MEMBER(RBH_STATX_ATIME_NSEC, stx_atime.tv_nsec),
+    STATX_MEMBER(RBH_STATX_BTIME_SEC, stx_btime.tv_sec),
+    STATX_MEMBER(RBH_STATX_BTIME_NSEC, stx_btime.tv_nsec),
+    STATX_MEMBER(RBH_STATX_CTIME_SEC, stx_ctime.tv_sec),
+    STATX_MEMBER(RBH_STATX_CTIME_NSEC, stx_ctime.tv_nsec),
+    STATX_MEMBER(RBH_STATX_MTIME_SEC, stx_mtime.tv_sec),
+    STATX_MEMBER(RBH_STATX_MTIME_NSEC, stx_mtime.tv_nsec),
+    STATX_MEMBER(RBH_STATX_INO, stx_ino),
+    STATX_MEMBER(RBH_STATX_SIZE, stx_size),
+    STATX_MEMBER(RBH_STATX_BLOCKS, stx_blocks),
+    STATX_MEMBER(RBH_STATX_MNT_ID, stx_mnt_id),
+    STATX_MEMBER(RBH_STATX_BLKSIZE, stx_blksize),
+    STATX_MEMBER(RBH_STATX_ATTRIBUTES, stx_attributes),
+    STATX_MEMBER(RBH_STATX_ATTRIBUTES, stx_attributes_mask),
+    STATX_MEMBER(RBH_STATX_RDEV_MAJOR, stx_rdev_major),
+    STATX_MEMBER(RBH_STATX_RDEV_MINOR, stx_rdev_minor),
+    STATX_MEMBER(RBH_STATX_DEV_MAJOR, stx_dev_major),
+    STATX_MEMBER(RBH_STATX_DEV_MINOR, stx_dev_minor),
+#undef STATX_MEMBER
+};
+
+static void
+store_le(void *buffer, uint64_t integer, size_t size)
+{
+    unsigned char *bytes = buffer;
+
+    for (size_t i = 0; i < size; i++, integer >>= 8)
+        bytes[i] = integer;
+}
+
+static uint64_t
+load_le(const void *buffer, size_t size)
+{
+    const unsigned char *bytes = buffer;
+    uint64_t integer = 0;
+
+    for (size_t i = size; i > 0; i--)
+        integer = (integer << 8) | bytes[i - 1];
+    return integer;
+}
+
+/* Native integers of 2, 4 or 8 bytes */
+static uint64_t
+load_native(const void *buffer, size_t size)
+{
+    switch (size) {
+    case sizeof(uint16_t):
+        return *(const uint16_t *)buffer;
+    case sizeof(uint32_t):
+        return *(const uint32_t *)buffer;
+    default:
+        return *(const uint64_t *)buffer;
+    }
+}
+
+static void
+store_native(void *buffer, uint64_t integer, size_t size)
+{
+    switch (size) {
+    case sizeof(uint16_t):
+        *(uint16_t *)buffer = integer;
+        break;
+    case sizeof(uint32_t):
+        *(uint32_t *)buffer = integer;
+        break;
+    default:
+        *(uint64_t *)buffer = integer;
+        break;
+    }
+}
+
+static void
+stream_set_pipe_size(FILE *file)
+{
+    /* Fails if `file' is not a pipe, which is fine */
+    fcntl(fileno(file), F_SETPIPE_SZ, RBH_STREAM_PIPE_SIZE);
+}
+
+/* When DEST is "-", fsevents are written there rather than applied */
+static FILE *output;
+
+struct frame {
+    char *data;
+    size_t size;
+    size_t capacity;
+    uint32_t values;
+};
+
+static void *
+frame_reserve(struct frame *frame, size_t size)
+{
+    if (frame->capacity - frame->size < size) {
+        size_t capacity = frame->capacity ? frame->capacity : 1 << 12;
+        char *data;
+
+        while (capacity - frame->size < size)
+            capacity *= 2;
+
+        data = realloc(frame->data, capacity);
+        if (data == NULL)
+            error(EXIT_FAILURE, errno, "realloc");
+
+        frame->data = data;
+        frame->capacity = capacity;
+    }
+
+    frame->size += size;
+    return frame->data + frame->size - size;
+}
+
+static void
+frame_put_uint(struct frame *frame, uint64_t integer, size_t size)
+{
+    store_le(frame_reserve(frame, size), integer, size);
+}
+
+static void
+frame_put_bytes(struct frame *frame, const void *data, size_t size)
+{
+    if (size > UINT32_MAX)
+        error(EXIT_FAILURE, EOVERFLOW, "cannot stream %zu bytes", size);
+
+    frame_put_uint(frame, size, sizeof(uint32_t));
+    if (size)
+        memcpy(frame_reserve(frame, size), data, size);
+}
+
+static void
+frame_put_string(struct frame *frame, const char *string)
+{
+    frame_put_bytes(frame, string, strlen(string) + 1);
+}
+
+static void
+frame_put_map(struct frame *frame, const struct rbh_value_map *map);
+
+static void
+frame_put_value(struct frame *frame, const struct rbh_value *value)
+{
+    if (value == NULL) {
+        frame_put_uint(frame, STREAM_VT_NONE, 1);
+        return;
+    }
+
+    frame->values++;
+    frame_put_uint(frame, value->type, 1);
+
+    switch (value->type) {
+    case RBH_VT_INT32:
+        frame_put_uint(frame, (uint32_t)value->int32, sizeof(uint32_t));
+        break;
+    case RBH_VT_UINT32:
+        frame_put_uint(frame, value->uint32, sizeof(uint32_t));
+        break;
+    case RBH_VT_INT64:
+        frame_put_uint(frame, value->int64, sizeof(uint64_t));
+        break;
+    case RBH_VT_UINT64:
+        frame_put_uint(frame, value->uint64, sizeof(uint64_t));
+        break;
+    case RBH_VT_STRING:
+        frame_put_string(frame, value->string);
+        break;
+    case RBH_VT_BINARY:
+        frame_put_bytes(frame, value->binary.data, value->binary.size);
+        break;
+    case RBH_VT_REGEX:
+        frame_put_uint(frame, value->regex.options, sizeof(uint32_t));
+        frame_put_string(frame, value->regex.string);
+        break;
+    case RBH_VT_SEQUENCE:
+        frame_put_uint(frame, value->sequence.count, sizeof(uint32_t));
+        for (size_t i = 0; i < value->sequence.count; i++)
+            frame_put_value(frame, &value->sequence.values[i]);
+        break;
+    case RBH_VT_MAP:
+        frame_put_map(frame, &value->map);
+        break;
+    }
+}
+
+static void
+frame_put_map(struct frame *frame, const struct rbh_value_map *map)
+{
+    frame_put_uint(frame, map->count, sizeof(uint32_t));
+    for (size_t i = 0; i < map->count; i++) {
+        frame->values++;
+        frame_put_string(frame, map->pairs[i].key);
+        frame_put_value(frame, map->pairs[i].value);
+    }
+}
+
+static void
+frame_put_statx(struct frame *frame, const struct rbh_statx *statx)
+{
+    frame_put_uint(frame, statx->stx_mask, sizeof(uint32_t));
+    for (size_t i = 0;
+         i < sizeof(STATX_MEMBERS) / sizeof(*STATX_MEMBERS); i++) {
+        const struct statx_member *member = &STATX_MEMBERS[i];
+
+        if (statx->stx_mask & member->mask)
+            frame_put_uint(frame,
+                           load_native((const char *)statx + member->offset,
+                                       member->size),
+                           member->size);
+    }
+}
+
+static void
+frame_put_name(struct frame *frame, const struct rbh_id *parent_id,
+               const char *name)
+{
+    frame_put_uint(frame, (parent_id ? SF_PARENT_ID : 0) | (name ? SF_NAME : 0),
+                   1);
+    if (parent_id)
+        frame_put_bytes(frame, parent_id->data, parent_id->size);
+    if (name)
+        frame_put_string(frame, name);
+}
+
+static void
+frame_put_fsevent(struct frame *frame, const struct rbh_fsevent *fsevent)
+{
+    const struct rbh_statx *statx;
+    const char *symlink;
+
+    frame_put_uint(frame, fsevent->type, 1);
+    frame_put_bytes(frame, fsevent->id.data, fsevent->id.size);
+    frame_put_map(frame, &fsevent->xattrs);
+
+    switch (fsevent->type) {
+    case RBH_FET_UPSERT:
+        statx = fsevent->upsert.statx;
+        symlink = fsevent->upsert.symlink;
+
+        frame_put_uint(frame, (statx ? SF_STATX : 0)
+                            | (symlink ? SF_SYMLINK : 0), 1);
+        if (statx)
+            frame_put_statx(frame, statx);
+        if (symlink)
+            frame_put_string(frame, symlink);
+        break;
+    case RBH_FET_LINK:
+    case RBH_FET_UNLINK:
+        frame_put_name(frame, fsevent->link.parent_id, fsevent->link.name);
+        break;
+    case RBH_FET_XATTR:
+        frame_put_name(frame, fsevent->ns.parent_id, fsevent->ns.name);
+        break;
+    case RBH_FET_DELETE:
+        break;
+    }
+}
+
+static void
+stream_write_frame(FILE *file, const struct frame *frame)
+{
+    if (fwrite(frame->data, frame->size, 1, file) != 1)
+        error(EXIT_FAILURE, errno, "fwrite");
+}
+
+/* Write the header of a stream to `file' */
+static void
+stream_start(FILE *file)
+{
+    struct frame header = {};
+
+    if (isatty(fileno(file)))
+        error(EX_USAGE, 0, "refusing to write an fsevent stream to a terminal");
+
+    if (setvbuf(file, NULL, _IOFBF, RBH_STREAM_BUFFER_SIZE))
+        error(EXIT_FAILURE, errno, "setvbuf");
+    stream_set_pipe_size(file);
+
+    memcpy(frame_reserve(&header, STREAM_MAGIC_SIZE), STREAM_MAGIC,
+           STREAM_MAGIC_SIZE);
+    frame_put_uint(&header, STREAM_VERSION, sizeof(uint32_t));
+    stream_write_frame(file, &header);
+    free(header.data);
+}
+
+/* Write `fsevents' to `file', one frame each */
+static void
+stream_write(FILE *file, struct rbh_iterator *fsevents)
+{
+    const struct rbh_fsevent *fsevent;
+    struct frame frame = {};
+    int save_errno;
+
+    while ((fsevent = rbh_iter_next(fsevents)) != NULL) {
+        frame.size = 0;
+        frame.values = 0;
+
+        /* SIZE and VALUES are only known once the fsevent is encoded */
+        frame_reserve(&frame, 2 * sizeof(uint32_t));
+        frame_put_fsevent(&frame, fsevent);
+
+        if (frame.size - 2 * sizeof(uint32_t) > UINT32_MAX)
+            error(EXIT_FAILURE, EOVERFLOW, "cannot stream a %zu bytes frame",
+                  frame.size);
+        store_le(frame.data, frame.size - 2 * sizeof(uint32_t),
+                 sizeof(uint32_t));
+        store_le(frame.data + sizeof(uint32_t), frame.values,
+                 sizeof(uint32_t));
+        stream_write_frame(file, &frame);
+    }
+
+    save_errno = errno;
+    rbh_iter_destroy(fsevents);
+    free(frame.data);
+
+    switch (save_errno) {
+    case ENODATA:
+        break;
+    case RBH_BACKEND_ERROR:
+        error(EXIT_FAILURE, 0, "unhandled error: %s", rbh_backend_error);
+        __builtin_unreachable();
+    default:
+        error(EXIT_FAILURE, save_errno,
+              "while iterating over SOURCE's entries");
+        __builtin_unreachable();
+    }
+}
+
+/* Write the end of the stream to `file', and flush it */
+static void
+stream_end(FILE *file)
+{
+    const char end[2 * sizeof(uint32_t)] = {};
+
+    if (fwrite(end, sizeof(end), 1, file) != 1)
+        error(EXIT_FAILURE, errno, "fwrite");
+    if (fflush(file))
+        error(EXIT_FAILURE, errno, "fflush");
+}
+
+    /*--------------------------------------------------------------------*
+     |                           iter_stream()                            |
+     *--------------------------------------------------------------------*/
+
+/* The decoded values and pairs of a frame are allocated from an arena, each
+ * allocation is padded to the alignment of the largest of them.
+ */
+union stream_node {
+    struct rbh_value value;
+    struct rbh_value_pair pair;
+};
+
+#define STREAM_NODE_ALIGN _Alignof(union stream_node)
+
+struct cursor {
+    const char *data;
+    size_t size;
+
+    char *arena;
+    size_t arena_size;
+};
+
+static void __attribute__((noreturn))
+stream_corrupted(void)
+{
+    error(EXIT_FAILURE, 0, "corrupted fsevent stream");
+    __builtin_unreachable();
+}
+
+static const char *
+cursor_take(struct cursor *cursor, size_t size)
+{
+    const char *data = cursor->data;
+
+    if (cursor->size < size)
+        stream_corrupted();
+
+    cursor->data += size;
+    cursor->size -= size;
+    return data;
+}
+
+static void *
+cursor_alloc(struct cursor *cursor, size_t count, size_t size)
+{
+    size_t padded = (count * size + STREAM_NODE_ALIGN - 1)
+                  & ~(STREAM_NODE_ALIGN - 1);
+    void *pointer = cursor->arena;
+
+    if (count == 0)
+        return NULL;
+
+    /* VALUES was too low */
+    if (cursor->arena_size < padded)
+        stream_corrupted();
+
+    cursor->arena += padded;
+    cursor->arena_size -= padded;
+    return pointer;
+}
+
+static uint64_t
+cursor_get_uint(struct cursor *cursor, size_t size)
+{
+    return load_le(cursor_take(cursor, size), size);
+}
+
+static const char *
+cursor_get_bytes(struct cursor *cursor, size_t *size)
+{
+    *size = cursor_get_uint(cursor, sizeof(uint32_t));
+    return cursor_take(cursor, *size);
+}
+
+static const char *
+cursor_get_string(struct cursor *cursor)
+{
+    const char *string;
+    size_t size;
+
+    string = cursor_get_bytes(cursor, &size);
+    if (size == 0 || string[size - 1] != '\0')
+        stream_corrupted();
+    return string;
+}
+
+static void
+cursor_get_map(struct cursor *cursor, struct rbh_value_map *map);
+
+static void
+cursor_fill_value(struct cursor *cursor, struct rbh_value *value)
+{
+    struct rbh_value *values;
+
+    value->type = cursor_get_uint(cursor, 1);
+    switch (value->type) {
+    case RBH_VT_INT32:
+        value->int32 = cursor_get_uint(cursor, sizeof(uint32_t));
+        break;
+    case RBH_VT_UINT32:
+        value->uint32 = cursor_get_uint(cursor, sizeof(uint32_t));
+        break;
+    case RBH_VT_INT64:
+        value->int64 = cursor_get_uint(cursor, sizeof(uint64_t));
+        break;
+    case RBH_VT_UINT64:
+        value->uint64 = cursor_get_uint(cursor, sizeof(uint64_t));
+        break;
+    case RBH_VT_STRING:
+        value->string = cursor_get_string(cursor);
+        break;
+    case RBH_VT_BINARY:
+        value->binary.data = cursor_get_bytes(cursor, &value->binary.size);
+        break;
+    case RBH_VT_REGEX:
+        value->regex.options = cursor_get_uint(cursor, sizeof(uint32_t));
+        value->regex.string = cursor_get_string(cursor);
+        break;
+    case RBH_VT_SEQUENCE:
+        value->sequence.count = cursor_get_uint(cursor, sizeof(uint32_t));
+        values = cursor_alloc(cursor, value->sequence.count, sizeof(*values));
+        for (size_t i = 0; i < value->sequence.count; i++)
+            cursor_fill_value(cursor, &values[i]);
+        value->sequence.values = values;
+        break;
+    case RBH_VT_MAP:
+        cursor_get_map(cursor, &value->map);
+        break;
+    default:
+        stream_corrupted();
+    }
+}
+
+static const struct rbh_value *
+cursor_get_value(struct cursor *cursor)
+{
+    struct rbh_value *value;
+
+    if (cursor->size && (uint8_t)cursor->data[0] == STREAM_VT_NONE) {
+        cursor_take(cursor, 1);
+        return NULL;
+    }
+
+    value = cursor_alloc(cursor, 1, sizeof(*value));
+    cursor_fill_value(cursor, value);
+    return value;
+}
+
+static void
+cursor_get_map(struct cursor *cursor, struct rbh_value_map *map)
+{
+    struct rbh_value_pair *pairs;
+
+    map->count = cursor_get_uint(cursor, sizeof(uint32_t));
+    pairs = cursor_alloc(cursor, map->count, sizeof(*pairs));
+    for (size_t i = 0; i < map->count; i++) {
+        pairs[i].key = cursor_get_string(cursor);
+        pairs[i].value = cursor_get_value(cursor);
+    }
+    map->pairs = pairs;
+}
+
+static const struct rbh_statx *
+cursor_get_statx(struct cursor *cursor, struct rbh_statx *statx)
+{
+    memset(statx, 0, sizeof(*statx));
+    statx->stx_mask = cursor_get_uint(cursor, sizeof(uint32_t));
+    for (size_t i = 0;
+         i < sizeof(STATX_MEMBERS) / sizeof(*STATX_MEMBERS); i++) {
+        const struct statx_member *member = &STATX_MEMBERS[i];
+
+        if (statx->stx_mask & member->mask)
+            store_native((char *)statx + member->offset,
+                         cursor_get_uint(cursor, member->size), member->size);
+    }
+    return statx;
+}
+
+static void
+cursor_get_name(struct cursor *cursor, struct rbh_id *buffer,
+                const struct rbh_id **parent_id, const char **name)
+{
+    uint8_t flags = cursor_get_uint(cursor, 1);
+
+    *parent_id = NULL;
+    if (flags & SF_PARENT_ID) {
+        buffer->data = cursor_get_bytes(cursor, &buffer->size);
+        *parent_id = buffer;
+    }
+    *name = flags & SF_NAME ? cursor_get_string(cursor) : NULL;
+}
+
+static void
+cursor_get_fsevent(struct cursor *cursor, struct rbh_fsevent *fsevent,
+                   struct rbh_statx *statx, struct rbh_id *parent_id)
+{
+    uint8_t flags;
+
+    fsevent->type = cursor_get_uint(cursor, 1);
+    fsevent->id.data = cursor_get_bytes(cursor, &fsevent->id.size);
+    cursor_get_map(cursor, &fsevent->xattrs);
+
+    switch (fsevent->type) {
+    case RBH_FET_UPSERT:
+        flags = cursor_get_uint(cursor, 1);
+        fsevent->upsert.statx =
+            flags & SF_STATX ? cursor_get_statx(cursor, statx) : NULL;
+        fsevent->upsert.symlink =
+            flags & SF_SYMLINK ? cursor_get_string(cursor) : NULL;
+        break;
+    case RBH_FET_LINK:
+    case RBH_FET_UNLINK:
+        cursor_get_name(cursor, parent_id, &fsevent->link.parent_id,
+                        &fsevent->link.name);
+        break;
+    case RBH_FET_XATTR:
+        cursor_get_name(cursor, parent_id, &fsevent->ns.parent_id,
+                        &fsevent->ns.name);
+        break;
+    case RBH_FET_DELETE:
+        break;
+    default:
+        stream_corrupted();
+    }
+
+    if (cursor->size)
+        stream_corrupted();
+}
+
+static void
+stream_read(FILE *file, void *buffer, size_t size)
+{
+    if (fread(buffer, size, 1, file) == 1)
+        return;
+
+    if (ferror(file))
+        error(EXIT_FAILURE, errno, "fread");
+    error(EXIT_FAILURE, 0, "truncated fsevent stream");
+}
+
+/* A stream_iterator decodes the frames of a stream, one at a time: each
+ * fsevent is only valid until the next one is read.
+ */
+struct stream_iterator {
+    struct rbh_iterator iterator;
+    FILE *file;
+    bool done;
+
+    char *frame;
+    size_t frame_size;
+    char *arena;
+    size_t arena_size;
+
+    struct rbh_fsevent fsevent;
+    struct rbh_statx statx;
+    struct rbh_id parent_id;
+};
+
+static void *
+stream_buffer(char **buffer, size_t *capacity, size_t size)
+{
+    if (*capacity < size) {
+        char *tmp = realloc(*buffer, size);
+
+        if (tmp == NULL)
+            error(EXIT_FAILURE, errno, "realloc");
+        *buffer = tmp;
+        *capacity = size;
+    }
+    return *buffer;
+}
+
+static const void *
+stream_iter_next(void *iterator)
+{
+    struct stream_iterator *stream = iterator;
+    char header[2 * sizeof(uint32_t)];
+    struct cursor cursor;
+    size_t values;
+    size_t size;
+
+    if (stream->done) {
+        errno = ENODATA;
+        return NULL;
+    }
+
+    stream_read(stream->file, header, sizeof(header));
+    size = load_le(header, sizeof(uint32_t));
+    values = load_le(header + sizeof(uint32_t), sizeof(uint32_t));
+
+    if (size == 0) {
+        stream->done = true;
+        errno = ENODATA;
+        return NULL;
+    }
+
+    /* Each value or pair takes at least a byte */
+    if (values > size)
+        stream_corrupted();
+
+    cursor.data = stream_buffer(&stream->frame, &stream->frame_size, size);
+    cursor.size = size;
+    stream_read(stream->file, stream->frame, size);
+
+    cursor.arena_size = values
+                      * (sizeof(union stream_node) + STREAM_NODE_ALIGN);
+    cursor.arena = stream_buffer(&stream->arena, &stream->arena_size,
+                                 cursor.arena_size);
+
+    cursor_get_fsevent(&cursor, &stream->fsevent, &stream->statx,
+                       &stream->parent_id);
+    return &stream->fsevent;
+}
+
+static void
+stream_iter_destroy(void *iterator)
+{
+    struct stream_iterator *stream = iterator;
+
+    free(stream->frame);
+    free(stream->arena);
+    free(stream);
+}
+
+static const struct rbh_iterator_operations STREAM_ITER_OPS = {
+    .next = stream_iter_next,
+    .destroy = stream_iter_destroy,
+};
+
+static const struct rbh_iterator STREAM_ITER = {
+    .ops = &STREAM_ITER_OPS,
+};
+
+/* Read the header of the stream in `file', and iterate over its fsevents */
+static struct rbh_iterator *
+iter_stream(FILE *file)
+{
+    char header[STREAM_MAGIC_SIZE + sizeof(uint32_t)];
+    struct stream_iterator *stream;
+    uint32_t version;
+
+    if (setvbuf(file, NULL, _IOFBF, RBH_STREAM_BUFFER_SIZE))
+        error(EXIT_FAILURE, errno, "setvbuf");
+    stream_set_pipe_size(file);
+
+    stream_read(file, header, sizeof(header));
+    if (memcmp(header, STREAM_MAGIC, STREAM_MAGIC_SIZE))
+        error(EXIT_FAILURE, 0, "not an fsevent stream");
+
+    version = load_le(header + STREAM_MAGIC_SIZE, sizeof(uint32_t));
+    if (version != STREAM_VERSION)
+        error(EXIT_FAILURE, 0, "unsupported fsevent stream version: %" PRIu32,
+              version);
+
+    stream = calloc(1, sizeof(*stream));
+    if (stream == NULL)
+        error(EXIT_FAILURE, errno, "calloc");
+
+    stream->iterator = STREAM_ITER;
+    stream->file = file;
+    return &stream->iterator;
+}
+
+    /*--------------------------------------------------------------------*
+     |                             work queue                             |
+     *--------------------------------------------------------------------*/
+
+/* Several rbh-sync processes, possibly on different nodes, can cooperate on a
+ * single sync by sharing a queue of work items, stored in a file.
+ *
+ * The file is protected by POSIX record locks, which also work on parallel
+ * filesystems, and holds one item per line:
+ *
+ *     STATE EXPIRY OWNER KIND PATH
+ *
+ * Where:
+ *   - STATE is one of "todo", "claimed" or "done";
+ *   - EXPIRY is the time (in seconds since the Epoch) at which the lease of a
+ *     claimed item expires, after which another process may claim it;
+ *   - OWNER identifies the process which claimed the item;
+ *   - KIND is either "tree", for PATH and all its descendants, or "one", for
+ *     PATH and those of its children that are not directories;
+ *   - PATH is a percent-encoded path, relative to SOURCE's root.
+ */
+
+#ifndef RBH_COORDINATE_LEASE
+# define RBH_COORDINATE_LEASE 300 /* seconds */
+#endif
+
+enum item_state {
+    IS_TODO,
+    IS_CLAIMED,
+    IS_DONE,
+};
+
+static const char *ITEM_STATES[] = {
+    [IS_TODO] = "todo",
+    [IS_CLAIMED] = "claimed",
+    [IS_DONE] = "done",
+};
+
+struct item {
+    enum item_state state;
+    time_t expiry;
+    char *owner;
+    bool tree;
+    char *path;
+};
+
+struct queue {
+    const char *filename;
+    int fd;
+    struct item *items;
+    size_t count;
+    size_t capacity;
+};
+
+static void
+queue_lock(struct queue *queue, short type)
+{
+    struct flock lock = {
+        .l_type = type,
+        .l_whence = SEEK_SET,
+    };
+
+    while (fcntl(queue->fd, F_SETLKW, &lock)) {
+        if (errno != EINTR)
+            error(EXIT_FAILURE, errno, "fcntl: %s", queue->filename);
+    }
+}
+
+static void
+queue_clear(struct queue *queue)
+{
+    for (size_t i = 0; i < queue->count; i++) {
+        free(queue->items[i].owner);
+        free(queue->items[i].path);
+    }
+    queue->count = 0;
+}
+
+static struct item *
+queue_find(struct queue *queue, bool tree, const char *path)
+{
+    for (size_t i = 0; i < queue->count; i++) {
+        struct item *item = &queue->items[i];
+
+        if (item->tree == tree && strcmp(item->path, path) == 0)
+            return item;
+    }
+    return NULL;
+}
+
+/* Add a new item to `queue', unless it is already there */
+static void
+queue_push(struct queue *queue, enum item_state state, time_t expiry,
+           const char *owner, bool tree, const char *path)
+{
+    struct item *item;
+
+    if (queue_find(queue, tree, path))
+        return;
+
+    if (queue->count == queue->capacity) {
+        size_t capacity = queue->capacity ? queue->capacity * 2 : 64;
+        void *items;
+
+        items = reallocarray(queue->items, capacity, sizeof(*queue->items));
+        if (items == NULL)
+            error(EXIT_FAILURE, errno, "reallocarray");
+
+        queue->items = items;
+        queue->capacity = capacity;
+    }
+
+    item = &queue->items[queue->count++];
+    item->state = state;
+    item->expiry = expiry;
+    item->owner = strdup(owner);
+    item->tree = tree;
+    item->path = strdup(path);
+    if (item->owner == NULL || item->path == NULL)
+        error(EXIT_FAILURE, errno, "strdup");
+}
+
+/* Must be called with the queue locked.
+ *
+ * Note that closing any file descriptor of the queue's file would release the
+ * lock, so do not use stdio to read it.
+ */
+static void
+queue_load(struct queue *queue)
+{
+    struct stat statbuf;
+    size_t lineno = 0;
+    char *buffer, *line;
+    size_t size = 0;
+
+    queue_clear(queue);
+
+    if (fstat(queue->fd, &statbuf))
+        error(EXIT_FAILURE, errno, "fstat: %s", queue->filename);
+
+    buffer = malloc(statbuf.st_size + 1);
+    if (buffer == NULL)
+        error(EXIT_FAILURE, errno, "malloc");
+
+    while (size < (size_t)statbuf.st_size) {
+        ssize_t rc = pread(queue->fd, buffer + size, statbuf.st_size - size,
+                           size);
+
+        if (rc < 0)
+            error(EXIT_FAILURE, errno, "pread: %s", queue->filename);
+        if (rc == 0)
+            break;
+        size += rc;
+    }
+    buffer[size] = '\0';
+
+    for (line = buffer; *line != '\0'; ) {
+        char *state, *owner, *kind, *path;
+        enum item_state item_state;
+        char *next = strchrnul(line, '\n');
+        intmax_t expiry;
+
+        if (*next != '\0')
+            *next++ = '\0';
+
+        lineno++;
+        if (sscanf(line, "%ms %jd %ms %ms %ms", &state, &expiry, &owner, &kind,
+                   &path) != 5)
+            error(EXIT_FAILURE, 0, "%s:%zu: invalid work item",
+                  queue->filename, lineno);
+
+        for (item_state = IS_TODO; item_state <= IS_DONE; item_state++) {
+            if (strcmp(state, ITEM_STATES[item_state]) == 0)
+                break;
+        }
+        if (item_state > IS_DONE
+         || (strcmp(kind, "tree") && strcmp(kind, "one")))
+            error(EXIT_FAILURE, 0, "%s:%zu: invalid work item",
+                  queue->filename, lineno);
+
+        queue_push(queue, item_state, expiry, owner, strcmp(kind, "tree") == 0,
+                   path);
+        free(state);
+        free(owner);
+        free(kind);
+        free(path);
+        line = next;
+    }
+
+    free(buffer);
+}
+
+/* Must be called with the queue locked */
+static void
+queue_store(struct queue *queue)
+{
+    char *buffer = NULL;
+    size_t size = 0;
+    FILE *stream;
+
+    stream = open_memstream(&buffer, &size);
+    if (stream == NULL)
+        error(EXIT_FAILURE, errno, "open_memstream");
+
+    for (size_t i = 0; i < queue->count; i++) {
+        const struct item *item = &queue->items[i];
+
+        fprintf(stream, "%s %jd %s %s %s\n", ITEM_STATES[item->state],
+                (intmax_t)item->expiry, item->owner,
+                item->tree ? "tree" : "one", item->path);
+    }
+
+    if (fclose(stream))
+        error(EXIT_FAILURE, errno, "fclose");
+
+    for (size_t offset = 0; offset < size; ) {
+        ssize_t rc = pwrite(queue->fd, buffer + offset, size - offset, offset);
+
+        if (rc < 0)
+            error(EXIT_FAILURE, errno, "pwrite: %s", queue->filename);
+        offset += rc;
+    }
+    free(buffer);
+
+    if (ftruncate(queue->fd, size) || fdatasync(queue->fd))
+        error(EXIT_FAILURE, errno, "%s", queue->filename);
+}
+
+/* The item this process is working on, if any */
+static struct {
+    struct queue *queue;
+    const char *owner;
+    bool tree;
+    const char *path;
+    time_t renewed;
+} lease;
+
+/* Extend `lease' if it is getting close to its expiry */
+static void
+lease_renew(void)
+{
+    struct item *item;
+    time_t now;
+
+    if (lease.queue == NULL)
+        return;
+
+    now = time(NULL);
+    if (now - lease.renewed < RBH_COORDINATE_LEASE / 4)
+        return;
+
+    queue_lock(lease.queue, F_WRLCK);
+    queue_load(lease.queue);
+    item = queue_find(lease.queue, lease.tree, lease.path);
+    if (item && item->state == IS_CLAIMED
+     && strcmp(item->owner, lease.owner) == 0) {
+        item->expiry = now + RBH_COORDINATE_LEASE;
+        queue_store(lease.queue);
+    }
+    queue_lock(lease.queue, F_UNLCK);
+
+    lease.renewed = now;
+}
+
+/* Set in main() to only read from SOURCE what the sync needs, so that
+ * converting fsentries into fsevents seldom has to mask out statx fields
+ */
+static struct rbh_filter_options source_options = {
+    .projection = {
+        .fsentry_mask = RBH_FP_ALL,
+        .statx_mask = RBH_STATX_ALL,
+    },
+};
+
+/* When to stop syncing (0 means never), see sync_prioritized() */
+static time_t deadline;
+
+/* Apply `fsevents' to `to'.
+ *
+ * Returns false if `deadline' passed before every fsevent was applied.
+ */
+static bool
+update_backend(struct rbh_backend *to, struct rbh_iterator *fsevents)
+{
+    struct rbh_mut_iterator *chunks;
+    int save_errno;
+
+    /* XXX: the mongo backend tries to process all the fsevents at once in a
+     *      single bulk operation, but a bulk operation is limited in size.
+     *
+     * Splitting `fsevents' into fixed-size sub-iterators solves this.
+     */
+    chunks = rbh_iter_chunkify(fsevents, RBH_ITER_CHUNK_SIZE);
+    if (chunks == NULL) {
+        save_errno = errno;
+        rbh_iter_destroy(fsevents);
+        error(EXIT_FAILURE, save_errno, "rbh_mut_iter_chunkify");
+    }
+
+    /* Update `to' */
+    do {
+        struct rbh_iterator *chunk = rbh_mut_iter_next(chunks);
+        ssize_t count;
+
+        if (chunk == NULL) {
+            if (errno == ENODATA || errno == RBH_BACKEND_ERROR)
+                break;
+            error(EXIT_FAILURE, errno, "while chunkifying SOURCE's entries");
+        }
+
+        /* Only give up if there is something left to sync */
+        if (deadline && time(NULL) >= deadline) {
+            rbh_iter_destroy(chunk);
+            errno = ETIME;
+            break;
+        }
+
+        count = rbh_backend_update(to, chunk);
+        save_errno = errno;
+        rbh_iter_destroy(chunk);
+        if (count < 0) {
+            errno = save_errno;
+            assert(errno != ENODATA);
+            break;
+        }
+
+        lease_renew();
+    } while (true);
+
+    save_errno = errno;
+    rbh_mut_iter_destroy(chunks);
+
+    switch (save_errno) {
+    case ENODATA:
+        return true;
+    case ETIME:
+        return false;
+    case RBH_BACKEND_ERROR:
+        error(EXIT_FAILURE, 0, "unhandled error: %s", rbh_backend_error);
+        __builtin_unreachable();
+    default:
+        error(EXIT_FAILURE, save_errno,
+              "while iterating over SOURCE's entries");
+        __builtin_unreachable();
+    }
+}
+
+/* Convert `fsentries' into fsevents and upsert them into `to' (or write them to
+ * `output', if set).
+ *
+ * Returns false if `deadline' passed before every fsentry was synced.
+ */
+static bool
+sync_fsentries(struct rbh_backend *to, struct rbh_mut_iterator *fsentries,
+               const struct rbh_filter_projection *projection)
+{
+    struct rbh_iterator *fsevents;
+    int save_errno;
+
+    /* Convert all this information into fsevents */
+    fsevents = iter_convert(fsentries, projection);
+    if (fsevents == NULL) {
+        save_errno = errno;
+        rbh_mut_iter_destroy(fsentries);
+        error(EXIT_FAILURE, save_errno, "iter_convert");
+    }
+
+    if (output) {
+        stream_write(output, fsevents);
+        return true;
+    }
+
+    return update_backend(to, fsevents);
+}
+
+/* Either `source''s root or all of its entries */
+static struct rbh_mut_iterator *
+source_fsentries(struct rbh_backend *source, bool root_only)
+{
+    struct rbh_mut_iterator *fsentries;
+
+    if (root_only) {
+        struct rbh_fsentry *root;
+
+        root = rbh_backend_root(source, &source_options.projection);
+        if (root == NULL)
+            error(EXIT_FAILURE, errno, "rbh_backend_root");
+
+        fsentries = mut_iter_one(root);
+        if (fsentries == NULL)
+            error(EXIT_FAILURE, errno, "rbh_mut_array_iterator");
+    } else {
+        /* "Dump" `source' */
+        fsentries = rbh_backend_filter(source, NULL, &source_options);
+        if (fsentries == NULL)
+            error(EXIT_FAILURE, errno, "rbh_backend_filter_fsentries");
+    }
+
+    return fsentries;
+}
+
+static void
+sync_backends(const struct rbh_filter_projection *projection)
+{
+    sync_fsentries(to, source_fsentries(from, one), projection);
+}
+
+/*----------------------------------------------------------------------------*
+ |                                sync_rollup()                               |
+ *----------------------------------------------------------------------------*/
+
+/* Quota reports need the disk usage and the number of entries under each
+ * directory. Rather than scanning DEST again after the sync, rbh-sync can
+ * aggregate those figures from the fsentries it syncs, and store them in DEST
+ * as a namespace xattr of each directory:
+ *
+ *     "rollup": { "entries": ..., "size": ..., "blocks": ... }
+ *
+ * where "entries" counts every entry under the directory (recursively), and
+ * "size"/"blocks" are the sums of their own. Hardlinks are counted once per
+ * link.
+ *
+ * Only directories get a node in the rollup table, other entries merely add to
+ * their parent's. Nodes (and the ids and names they reference) live in mmapped
+ * temporary files: the kernel is free to write them back and evict them when
+ * the table grows bigger than the memory it can spare.
+ */
+
+#ifndef RBH_ROLLUP_XATTR
+# define RBH_ROLLUP_XATTR "rollup"
+#endif
+
+/* Initial size of each of the rollup table's temporary files */
+#ifndef RBH_ROLLUP_SPILL_SIZE
+# define RBH_ROLLUP_SPILL_SIZE (1 << 20)
+#endif
+
+    /*--------------------------------------------------------------------*
+     |                               spill                                |
+     *--------------------------------------------------------------------*/
+
+/* A growable buffer, backed by an unlinked temporary file */
+struct spill {
+    int fd;
+    char *data;
+    size_t size;
+    size_t capacity;
+};
+
+static void
+spill_init(struct spill *spill)
+{
+    const char *tmpdir = getenv("TMPDIR") ? : "/tmp";
+    char *path;
+
+    if (asprintf(&path, "%s/rbh-sync.XXXXXX", tmpdir) < 0)
+        error(EXIT_FAILURE, errno, "asprintf");
+
+    spill->fd = mkostemp(path, O_CLOEXEC);
+    if (spill->fd < 0)
+        error(EXIT_FAILURE, errno, "mkostemp: %s", path);
+    unlink(path);
+    free(path);
+
+    spill->data = NULL;
+    spill->size = 0;
+    spill->capacity = 0;
+}
+
+/* Append `size' zeroed bytes to `spill', and return a pointer to them.
+ *
+ * Pointers into `spill' are invalidated by subsequent calls.
+ */
+static void *
+spill_reserve(struct spill *spill, size_t size)
+{
+    void *data;
+
+    if (spill->size + size > spill->capacity) {
+        size_t capacity = spill->capacity ? : RBH_ROLLUP_SPILL_SIZE;
+
+        while (capacity < spill->size + size)
+            capacity *= 2;
+
+        if (ftruncate(spill->fd, capacity))
+            error(EXIT_FAILURE, errno, "ftruncate");
+
+        if (spill->data)
+            data = mremap(spill->data, spill->capacity, capacity,
+                          MREMAP_MAYMOVE);
+        else
+            data = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED,
+                        spill->fd, 0);
+        if (data == MAP_FAILED)
+            error(EXIT_FAILURE, errno, "mmap");
+
+        spill->data = data;
+        spill->capacity = capacity;
+    }
+
+    data = spill->data + spill->size;
+    spill->size += size;
+    return data;
+}
+
+static void
+spill_fini(struct spill *spill)
+{
+    if (spill->data)
+        munmap(spill->data, spill->capacity);
+    close(spill->fd);
+}
+
+    /*--------------------------------------------------------------------*
+     |                               rollup                               |
+     *--------------------------------------------------------------------*/
+
+#define ROLLUP_NONE UINT32_MAX
+
+struct rollup_node {
+    uint64_t hash;
+    /* Offsets of the directory's id and name in `rollup->strings' */
+    uint64_t id;
+    uint64_t name;
+    uint32_t id_size;
+    /* Index of the parent's node */
+    uint32_t parent;
+    /* Number of subdirectories whose totals were not added yet */
+    uint32_t pending;
+    /* Whether the directory's own fsentry was seen */
+    bool seen;
+    bool done;
+    uint64_t entries;
+    uint64_t size;
+    uint64_t blocks;
+};
+
+struct rollup {
+    /* struct rollup_node[] */
+    struct spill nodes;
+    /* Ids and names (NUL-terminated) */
+    struct spill strings;
+    /* Open addressing hash table of (node index + 1), 0 marks empty slots */
+    struct spill buckets;
+    size_t count;
+};
+
+static struct rollup_node *
+rollup_nodes(const struct rollup *rollup)
+{
+    return (struct rollup_node *)rollup->nodes.data;
+}
+
+static uint32_t *
+rollup_buckets(const struct rollup *rollup)
+{
+    return (uint32_t *)rollup->buckets.data;
+}
+
+static size_t
+rollup_bucket_count(const struct rollup *rollup)
+{
+    return rollup->buckets.size / sizeof(uint32_t);
+}
+
+static void
+rollup_init(struct rollup *rollup)
+{
+    spill_init(&rollup->nodes);
+    spill_init(&rollup->strings);
+    spill_init(&rollup->buckets);
+    spill_reserve(&rollup->buckets, 1024 * sizeof(uint32_t));
+    rollup->count = 0;
+}
+
+static void
+rollup_fini(struct rollup *rollup)
+{
+    spill_fini(&rollup->buckets);
+    spill_fini(&rollup->strings);
+    spill_fini(&rollup->nodes);
+}
+
+static uint32_t *
+rollup_bucket(const struct rollup *rollup, uint64_t hash,
+              const struct rbh_id *id)
+{
+    const struct rollup_node *nodes = rollup_nodes(rollup);
+    uint32_t *buckets = rollup_buckets(rollup);
+    size_t mask = rollup_bucket_count(rollup) - 1;
+
+    for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+        const struct rollup_node *node;
+
+        if (buckets[i] == 0)
+            return &buckets[i];
+
+        node = &nodes[buckets[i] - 1];
+        if (node->hash == hash && node->id_size == id->size
+         && memcmp(rollup->strings.data + node->id, id->data, id->size) == 0)
+            return &buckets[i];
+    }
+}
+
+/* Double the number of buckets once they are 3/4 full */
+static void
+rollup_grow(struct rollup *rollup)
+{
+    const struct rollup_node *nodes = rollup_nodes(rollup);
+    size_t count = rollup_bucket_count(rollup);
+    uint32_t *buckets;
+    size_t mask;
+
+    if (rollup->count < count / 4 * 3)
+        return;
+
+    spill_fini(&rollup->buckets);
+    spill_init(&rollup->buckets);
+    buckets = spill_reserve(&rollup->buckets, 2 * count * sizeof(*buckets));
+
+    mask = 2 * count - 1;
+    for (size_t i = 0; i < rollup->count; i++) {
+        size_t j;
+
+        for (j = nodes[i].hash & mask; buckets[j]; j = (j + 1) & mask);
+        buckets[j] = i + 1;
+    }
+}
+
+static char *
+rollup_strdup(struct rollup *rollup, const void *data, size_t size,
+              uint64_t *offset)
+{
+    char *copy;
+
+    *offset = rollup->strings.size;
+    copy = spill_reserve(&rollup->strings, size + 1);
+    memcpy(copy, data, size);
+    return copy;
+}
+
+/* The index of `id''s node, which is created if need be */
+static uint32_t
+rollup_node(struct rollup *rollup, const struct rbh_id *id)
+{
+    uint64_t hash = hash_bytes(id->data, id->size);
+    struct rollup_node *node;
+    uint32_t *bucket;
+
+    bucket = rollup_bucket(rollup, hash, id);
+    if (*bucket)
+        return *bucket - 1;
+
+    if (rollup->count == ROLLUP_NONE)
+        error(EXIT_FAILURE, EOVERFLOW, "rollup_node");
+
+    node = spill_reserve(&rollup->nodes, sizeof(*node));
+    node->hash = hash;
+    rollup_strdup(rollup, id->data, id->size, &node->id);
+    node->id_size = id->size;
+    node->parent = ROLLUP_NONE;
+    *bucket = ++rollup->count;
+
+    rollup_grow(rollup);
+    return rollup->count - 1;
+}
+
+static void
+rollup_add(struct rollup *rollup, const struct rbh_fsentry *fsentry)
+{
+    const struct rbh_statx *statx = NULL;
+    struct rollup_node *node;
+    uint32_t parent, self;
+
+    if (!(fsentry->mask & RBH_FP_ID) || !(fsentry->mask & RBH_FP_PARENT_ID))
+        return;
+
+    if (fsentry->mask & RBH_FP_STATX)
+        statx = fsentry->statx;
+
+    parent = rollup_node(rollup, &fsentry->parent_id);
+    node = &rollup_nodes(rollup)[parent];
+    node->entries++;
+    if (statx && (statx->stx_mask & RBH_STATX_SIZE))
+        node->size += statx->stx_size;
+    if (statx && (statx->stx_mask & RBH_STATX_BLOCKS))
+        node->blocks += statx->stx_blocks;
+
+    if (statx == NULL || !(statx->stx_mask & RBH_STATX_TYPE)
+     || !S_ISDIR(statx->stx_mode) || !(fsentry->mask & RBH_FP_NAME))
+        return;
+
+    self = rollup_node(rollup, &fsentry->id);
+    node = &rollup_nodes(rollup)[self];
+    if (node->seen || self == parent)
+        return;
+
+    node->seen = true;
+    node->parent = parent;
+    rollup_strdup(rollup, fsentry->name, strlen(fsentry->name), &node->name);
+    /* rollup_strdup() does not move nodes */
+    rollup_nodes(rollup)[parent].pending++;
+}
+
+/* Add each directory's totals to its ancestors' */
+static void
+rollup_propagate(struct rollup *rollup)
+{
+    struct rollup_node *nodes = rollup_nodes(rollup);
+
+    for (size_t i = 0; i < rollup->count; i++) {
+        struct rollup_node *node = &nodes[i];
+
+        while (!node->done && node->pending == 0) {
+            struct rollup_node *parent;
+
+            node->done = true;
+            if (node->parent == ROLLUP_NONE)
+                break;
+
+            parent = &nodes[node->parent];
+            parent->entries += node->entries;
+            parent->size += node->size;
+            parent->blocks += node->blocks;
+            parent->pending--;
+            node = parent;
+        }
+    }
+}
+
+    /*--------------------------------------------------------------------*
+     |                           iter_rollup()                            |
+     *--------------------------------------------------------------------*/
+
+/* A rollup_iterator adds the fsentries it yields to a rollup table */
+struct rollup_iterator {
+    struct rbh_mut_iterator iterator;
+    struct rbh_mut_iterator *fsentries;
+    struct rollup *rollup;
+};
+
+static void *
+rollup_iter_next(void *iterator)
+{
+    struct rollup_iterator *rollups = iterator;
+    struct rbh_fsentry *fsentry;
+
+    fsentry = rbh_mut_iter_next(rollups->fsentries);
+    if (fsentry)
+        rollup_add(rollups->rollup, fsentry);
+    return fsentry;
+}
+
+static void
+rollup_iter_destroy(void *iterator)
+{
+    struct rollup_iterator *rollups = iterator;
+
+    rbh_mut_iter_destroy(rollups->fsentries);
+    free(rollups);
+}
+
+static const struct rbh_mut_iterator_operations ROLLUP_ITER_OPS = {
+    .next = rollup_iter_next,
+    .destroy = rollup_iter_destroy,
+};
+
+static const struct rbh_mut_iterator ROLLUP_ITERATOR = {
+    .ops = &ROLLUP_ITER_OPS,
+};
+
+static struct rbh_mut_iterator *
+iter_rollup(struct rbh_mut_iterator *fsentries, struct rollup *rollup)
+{
+    struct rollup_iterator *rollups;
+
+    rollups = malloc(sizeof(*rollups));
+    if (rollups == NULL)
+        error(EXIT_FAILURE, errno, "malloc");
+
+    rollups->iterator = ROLLUP_ITERATOR;
+    rollups->fsentries = fsentries;
+    rollups->rollup = rollup;
+    return &rollups->iterator;
+}
+
+    /*--------------------------------------------------------------------*
+     |                           iter_rollups()                           |
+     *--------------------------------------------------------------------*/
+
+/* A rollups_iterator yields an RBH_FET_XATTR fsevent per directory of a rollup
+ * table, which sets the directory's RBH_ROLLUP_XATTR namespace xattr
+ */
+struct rollups_iterator {
+    struct rbh_iterator iterator;
+    const struct rollup *rollup;
+    size_t index;
+
+    struct rbh_fsevent fsevent;
+    struct rbh_id parent_id;
+    struct rbh_value_pair pair;
+    struct rbh_value value;
+    struct rbh_value_pair totals[3];
+    struct rbh_value values[3];
+};
+
+static const void *
+rollups_iter_next(void *iterator)
+{
+    struct rollups_iterator *rollups = iterator;
+    const struct rollup_node *nodes = rollup_nodes(rollups->rollup);
+    const char *strings = rollups->rollup->strings.data;
+    const struct rollup_node *node, *parent;
+
+    do {
+        if (rollups->index == rollups->rollup->count) {
+            errno = ENODATA;
+            return NULL;
+        }
+        node = &nodes[rollups->index++];
+    } while (!node->seen);
+    parent = &nodes[node->parent];
+
+    rollups->values[0].uint64 = node->entries;
+    rollups->values[1].uint64 = node->size;
+    rollups->values[2].uint64 = node->blocks;
+
+    rollups->fsevent.id.data = strings + node->id;
+    rollups->fsevent.id.size = node->id_size;
+    rollups->parent_id.data = strings + parent->id;
+    rollups->parent_id.size = parent->id_size;
+    rollups->fsevent.ns.parent_id = &rollups->parent_id;
+    rollups->fsevent.ns.name = strings + node->name;
+    return &rollups->fsevent;
+}
+
+static void
+rollups_iter_destroy(void *iterator)
+{
+    free(iterator);
+}
+
+static const struct rbh_iterator_operations ROLLUPS_ITER_OPS = {
+    .next = rollups_iter_next,
+    .destroy = rollups_iter_destroy,
+};
+
+static const struct rbh_iterator ROLLUPS_ITERATOR = {
+    .ops = &ROLLUPS_ITER_OPS,
+};
+
+static struct rbh_iterator *
+iter_rollups(const struct rollup *rollup)
+{
+    static const char *const KEYS[] = { "entries", "size", "blocks" };
+    struct rollups_iterator *rollups;
+
+    rollups = malloc(sizeof(*rollups));
+    if (rollups == NULL)
+        error(EXIT_FAILURE, errno, "malloc");
+
+    rollups->iterator = ROLLUPS_ITERATOR;
+    rollups->rollup = rollup;
+    rollups->index = 0;
+
+    for (size_t i = 0; i < 3; i++) {
+        rollups->values[i].type = RBH_VT_UINT64;
+        rollups->totals[i].key = KEYS[i];
+        rollups->totals[i].value = &rollups->values[i];
+    }
+    rollups->value.type = RBH_VT_MAP;
+    rollups->value.map.pairs = rollups->totals;
+    rollups->value.map.count = 3;
+    rollups->pair.key = RBH_ROLLUP_XATTR;
+    rollups->pair.value = &rollups->value;
+
+    rollups->fsevent.type = RBH_FET_XATTR;
+    rollups->fsevent.xattrs.pairs = &rollups->pair;
+    rollups->fsevent.xattrs.count = 1;
+    return &rollups->iterator;
+}
+
+static void
+sync_rollup(const struct rbh_filter_projection *projection)
+{
+    struct rollup rollup;
+
+    rollup_init(&rollup);
+
+    sync_fsentries(to, iter_rollup(source_fsentries(from, false), &rollup),
+                   projection);
+
+    rollup_propagate(&rollup);
+    update_backend(to, iter_rollups(&rollup));
+
+    rollup_fini(&rollup);
+}
+
+/*----------------------------------------------------------------------------*
+ |                             sync_coordinated()                             |
+ *----------------------------------------------------------------------------*/
+
+/* The first process to use a work queue seeds it with a single "tree" item:
+ * SOURCE itself. Whoever claims a "tree" item of a directory which is worth
+ * splitting (SOURCE's root always is, as are directories that contain other
+ * directories, up to RBH_COORDINATE_DEPTH levels deep) replaces it with a
+ * "one" item for the directory, and a "tree" item per subdirectory.
+ *
+ * Processes claim items until none is left. An item claimed by a process that
+ * crashed is claimed again once its lease expires.
+ */
+
+#ifndef RBH_COORDINATE_DEPTH
+# define RBH_COORDINATE_DEPTH 3
+#endif
+
+static struct rbh_uri *
+uri_from_string(const char *string)
+{
+    struct rbh_raw_uri *raw_uri;
+    struct rbh_uri *uri;
+
+    raw_uri = rbh_raw_uri_from_string(string);
+    if (raw_uri == NULL)
+        return NULL;
+
+    uri = rbh_uri_from_raw_uri(raw_uri);
+    free(raw_uri);
+    return uri;
+}
+
+/* Does `string' reference a whole mongo backend (no #PATH or #[ID])? */
+static bool
+is_whole_mongo_backend(const char *string)
+{
+    struct rbh_uri *uri = uri_from_string(string);
+    bool whole;
+
+    if (uri == NULL)
+        return false;
+
+    whole = strcmp(uri->backend, "mongo") == 0 && uri->type == RBH_UT_BARE;
+    free(uri);
+    return whole;
+}
+
+static bool
+is_unreserved(char c)
+{
+    return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z')
+        || ('0' <= c && c <= '9') || strchr("-._~", c);
+}
+
+static char *
+percent_encode(const char *string)
+{
+    char *encoded, *c;
+
+    encoded = malloc(strlen(string) * 3 + 1);
+    if (encoded == NULL)
+        error(EXIT_FAILURE, errno, "malloc");
+
+    for (c = encoded; *string; string++) {
+        if (is_unreserved(*string))
+            *c++ = *string;
+        else
+            c += sprintf(c, "%%%02X", (unsigned char)*string);
+    }
+    *c = '\0';
+
+    return encoded;
+}
+
+static char *
+percent_decode(const char *string)
+{
+    char *decoded, *c;
+
+    decoded = malloc(strlen(string) + 1);
+    if (decoded == NULL)
+        error(EXIT_FAILURE, errno, "malloc");
+
+    for (c = decoded; *string; c++) {
+        unsigned int byte;
+
+        if (string[0] == '%' && sscanf(string + 1, "%2x", &byte) == 1) {
+            *c = byte;
+            string += 3;
+        } else {
+            *c = *string++;
+        }
+    }
+    *c = '\0';
+
+    return decoded;
+}
+
+/* A path relative to SOURCE's root, and percent-encoded, as stored in items */
+static char *
+path_join(const char *parent, const char *name)
+{
+    char *encoded, *path;
+
+    encoded = percent_encode(name);
+    if (strcmp(parent, ".") == 0)
+        return encoded;
+
+    if (asprintf(&path, "%s/%s", parent, encoded) < 0)
+        error(EXIT_FAILURE, errno, "asprintf");
+    free(encoded);
+    return path;
+}
+
+/* A SOURCE whose FSNAME is a local path, which can therefore be split into
+ * subtrees without going through its backend
+ */
+struct local_tree {
+    /* SOURCE, without its fragment */
+    char *base;
+    /* SOURCE's FSNAME */
+    const char *root;
+    /* The item SOURCE references */
+    char *seed;
+    const struct rbh_filter_projection *projection;
+    struct rbh_uri *uri;
+};
+
+/* Exit with EX_USAGE unless `uri' can be used as a local tree.
+ *
+ * `option' is only used in error messages.
+ */
+static void
+local_tree_check(const struct rbh_uri *uri, const char *option)
+{
+    struct stat statbuf;
+
+    if (stat(uri->fsname, &statbuf) || !S_ISDIR(statbuf.st_mode))
+        error(EX_USAGE, 0,
+              "%s requires a SOURCE whose FSNAME is a local path", option);
+    if (uri->type == RBH_UT_ID)
+        error(EX_USAGE, 0, "%s does not support SOURCE's [ID]", option);
+}
+
+/* `option' is only used in error messages */
+static void
+local_tree_init(struct local_tree *tree, const char *source,
+                const struct rbh_filter_projection *projection,
+                const char *option)
+{
+    char *fragment;
+
+    tree->projection = projection;
+    tree->uri = uri_from_string(source);
+    if (tree->uri == NULL)
+        error(EXIT_FAILURE, errno, "cannot parse URI: %s", source);
+
+    local_tree_check(tree->uri, option);
+    tree->root = tree->uri->fsname;
+
+    tree->base = strdup(source);
+    if (tree->base == NULL)
+        error(EXIT_FAILURE, errno, "strdup");
+
+    fragment = strchr(tree->base, '#');
+    if (fragment) {
+        size_t length;
+
+        *fragment++ = '\0';
+        length = strlen(fragment);
+        while (length > 0 && fragment[length - 1] == '/')
+            fragment[--length] = '\0';
+    }
+    tree->seed = strdup(fragment && *fragment ? fragment : ".");
+    if (tree->seed == NULL)
+        error(EXIT_FAILURE, errno, "strdup");
+}
+
+static void
+local_tree_fini(struct local_tree *tree)
+{
+    free(tree->seed);
+    free(tree->base);
+    free(tree->uri);
+}
+
+struct coordination {
+    struct queue queue;
+    char owner[HOST_NAME_MAX + 32];
+    struct local_tree tree;
+};
+
+static char *
+item_uri(const struct local_tree *tree, const char *path)
+{
+    char *uri;
+
+    if (strcmp(path, ".") == 0)
+        return strdup(tree->base);
+
+    if (asprintf(&uri, "%s#%s", tree->base, path) < 0)
+        return NULL;
+    return uri;
+}
+
+static char *
+item_local_path(const struct local_tree *tree, const char *path)
+{
+    char *decoded, *local;
+
+    decoded = percent_decode(path);
+    if (asprintf(&local, "%s/%s", tree->root, decoded) < 0)
+        error(EXIT_FAILURE, errno, "asprintf");
+    free(decoded);
+    return local;
+}
+
+static size_t
+item_depth(const struct local_tree *tree, const char *path)
+{
+    size_t depth = 0;
+
+    if (strcmp(path, tree->seed) == 0)
+        return 0;
+
+    if (strcmp(tree->seed, ".") != 0)
+        path += strlen(tree->seed);
+
+    for (depth = 1; (path = strchr(path + 1, '/')) != NULL; depth++);
+
+    return depth;
+}
+
+    /*--------------------------------------------------------------------*
+     |                          iter_children()                           |
+     *--------------------------------------------------------------------*/
+
+/* A children_iterator yields the fsentries of some of a directory's entries
+ * (and optionally of the directory itself).
+ *
+ * Only one backend is instantiated, for the directory: each entry is reached
+ * by branching off of it, with the ID of the entry's file handle. Entries that
+ * were removed since they were listed are skipped.
+ */
+struct children_iterator {
+    struct rbh_mut_iterator iterator;
+    struct rbh_backend *backend;
+    struct file_handle *handle;
+    int dirfd;
+    bool self;
+
+    /* Entries whose ctime is older than this are skipped */
+    int64_t since;
+    char **paths;
+    size_t count;
+    size_t index;
+};
+
+/* Whether `name', an entry of the iterator's directory, did not change after
+ * the iterator's `since'
+ */
+static bool
+is_unchanged_child(struct children_iterator *children, const char *name)
+{
+    struct stat statbuf;
+
+    if (children->since == INT64_MIN)
+        return false;
+
+    /* Let child_fsentry() deal with errors */
+    return fstatat(children->dirfd, name, &statbuf, AT_SYMLINK_NOFOLLOW) == 0
+        && statbuf.st_ctim.tv_sec < children->since;
+}
+
+/* Fetch the fsentry of `name', an entry of the iterator's directory */
+static struct rbh_fsentry *
+child_fsentry(struct children_iterator *children, const char *name)
+{
+    struct rbh_fsentry *fsentry;
+    struct rbh_backend *branch;
+    struct rbh_id *id;
+    int save_errno;
+    int mount_id;
+
+    children->handle->handle_bytes = MAX_HANDLE_SZ;
+    if (name_to_handle_at(children->dirfd, name, children->handle, &mount_id,
+                          0))
+        return NULL;
+
+    id = rbh_id_from_file_handle(children->handle);
+    if (id == NULL)
+        error(EXIT_FAILURE, errno, "rbh_id_from_file_handle");
+
+    branch = rbh_backend_branch(children->backend, id);
+    free(id);
+    if (branch == NULL)
+        return NULL;
+
+    fsentry = rbh_backend_root(branch, &source_options.projection);
+    save_errno = errno;
+    rbh_backend_destroy(branch);
+    errno = save_errno;
+    return fsentry;
+}
+
+static void *
+children_iter_next(void *iterator)
+{
+    struct children_iterator *children = iterator;
+    struct rbh_fsentry *fsentry;
+
+    if (children->self) {
+        children->self = false;
+        fsentry = rbh_backend_root(children->backend,
+                                   &source_options.projection);
+        if (fsentry != NULL || errno != ENOENT)
+            return fsentry;
+    }
+
+    while (children->index < children->count) {
+        const char *path = children->paths[children->index++];
+        const char *slash = strrchr(path, '/');
+        int save_errno;
+        char *name;
+
+        name = percent_decode(slash ? slash + 1 : path);
+        if (is_unchanged_child(children, name)) {
+            free(name);
+            continue;
+        }
+
+        fsentry = child_fsentry(children, name);
+        save_errno = errno;
+        free(name);
+
+        /* Skip the entries that were removed since they were listed */
+        if (fsentry == NULL && (save_errno == ENOENT || save_errno == ESTALE))
+            continue;
+
+        errno = save_errno;
+        return fsentry;
+    }
+
+    errno = ENODATA;
+    return NULL;
+}
+
+static void
+children_iter_destroy(void *iterator)
+{
+    struct children_iterator *children = iterator;
+
+    for (size_t i = 0; i < children->count; i++)
+        free(children->paths[i]);
+    free(children->paths);
+    if (children->dirfd >= 0) {
+        close(children->dirfd);
+        rbh_backend_destroy(children->backend);
+    }
+    free(children->handle);
+    free(children);
+}
+
+static const struct rbh_mut_iterator_operations CHILDREN_ITER_OPS = {
+    .next = children_iter_next,
+    .destroy = children_iter_destroy,
+};
+
+static const struct rbh_mut_iterator CHILDREN_ITERATOR = {
+    .ops = &CHILDREN_ITER_OPS,
+};
+
+/* Yield the fsentries of `paths', entries of the directory `path' (and that of
+ * `path' itself if `self' is set), which changed after `since' (INT64_MIN to
+ * yield them all).
+ *
+ * Takes ownership of `paths'.
+ */
+static struct rbh_mut_iterator *
+iter_children(const struct local_tree *tree, const char *path, bool self,
+              char **paths, size_t count, int64_t since)
+{
+    struct children_iterator *children;
+    char *local;
+
+    children = malloc(sizeof(*children));
+    if (children == NULL)
+        error(EXIT_FAILURE, errno, "malloc");
+    children->handle = malloc(sizeof(*children->handle) + MAX_HANDLE_SZ);
+    if (children->handle == NULL)
+        error(EXIT_FAILURE, errno, "malloc");
+
+    children->iterator = CHILDREN_ITERATOR;
+    children->self = self;
+    children->since = since;
+    children->paths = paths;
+    children->count = count;
+    children->index = 0;
+
+    local = item_local_path(tree, path);
+    children->dirfd = open(local, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (children->dirfd < 0) {
+        /* `path' was removed, or is not a directory anymore */
+        if (errno != ENOENT && errno != ENOTDIR)
+            error(EXIT_FAILURE, errno, "open: %s", local);
+        children->self = false;
+        children->index = count;
+    } else {
+        char *uri = item_uri(tree, path);
+
+        if (uri == NULL)
+            error(EXIT_FAILURE, errno, "item_uri");
+        children->backend = rbh_backend_from_uri(uri);
+        free(uri);
+    }
+    free(local);
+
+    return &children->iterator;
+}
+
+    /*--------------------------------------------------------------------*
+     |                           process_item()                           |
+     *--------------------------------------------------------------------*/
+
+/* List the children of `path' which are (or are not) directories, as items'
+ * paths
+ */
+static char **
+list_children(const struct local_tree *tree, const char *path,
+              bool directories, size_t *count)
+{
+    char *local = item_local_path(tree, path);
+    size_t capacity = 0;
+    char **children = NULL;
+    struct dirent *dirent;
+    DIR *dir;
+
+    *count = 0;
+
+    dir = opendir(local);
+    if (dir == NULL) {
+        /* `path' was removed, or is not a directory anymore */
+        if (errno == ENOENT || errno == ENOTDIR) {
+            free(local);
+            return NULL;
+        }
+        error(EXIT_FAILURE, errno, "opendir: %s", local);
+    }
+
+    while ((errno = 0, dirent = readdir(dir)) != NULL) {
+        unsigned char type = dirent->d_type;
+
+        if (strcmp(dirent->d_name, ".") == 0
+         || strcmp(dirent->d_name, "..") == 0)
+            continue;
+
+        if (type == DT_UNKNOWN) {
+            struct stat statbuf;
+
+            if (fstatat(dirfd(dir), dirent->d_name, &statbuf,
+                        AT_SYMLINK_NOFOLLOW))
+                continue;
+            type = S_ISDIR(statbuf.st_mode) ? DT_DIR : DT_REG;
+        }
+
+        if ((type == DT_DIR) != directories)
+            continue;
+
+        if (*count == capacity) {
+            void *tmp;
+
+            capacity = capacity ? capacity * 2 : 64;
+            tmp = reallocarray(children, capacity, sizeof(*children));
+            if (tmp == NULL)
+                error(EXIT_FAILURE, errno, "reallocarray");
+            children = tmp;
+        }
+        children[(*count)++] = path_join(path, dirent->d_name);
+    }
+    if (errno)
+        error(EXIT_FAILURE, errno, "readdir: %s", local);
+
+    closedir(dir);
+    free(local);
+    return children;
+}
+
+static bool
+is_worth_splitting(const struct local_tree *tree, const char *path)
+{
+    size_t depth = item_depth(tree, path);
+    struct stat statbuf;
+    char *local;
+    int rc;
+
+    if (depth == 0)
+        return true;
+    if (depth >= RBH_COORDINATE_DEPTH)
+        return false;
+
+    local = item_local_path(tree, path);
+    rc = lstat(local, &statbuf);
+    free(local);
+
+    /* A directory's nlink is 2 when it has no subdirectory (and 1 when the
+     * filesystem does not keep track of it)
+     */
+    return rc == 0 && S_ISDIR(statbuf.st_mode) && statbuf.st_nlink != 2;
+}
+
+/* Sync `path' and its children which are not directories.
+ *
+ * Returns false if the deadline interrupted the sync.
+ */
+static bool
+process_one(const struct local_tree *tree, const char *path)
+{
+    char **children;
+    size_t count;
+
+    children = list_children(tree, path, false, &count);
+    return sync_fsentries(to, iter_children(tree, path, true, children, count,
+                                            INT64_MIN),
+                          tree->projection);
+}
+
+/* Returns false if the deadline interrupted the sync.
+ *
+ * A subtree that was removed since it was queued is done already.
+ */
+static bool
+process_tree(const struct local_tree *tree, const char *path)
+{
+    struct rbh_mut_iterator *fsentries;
+    struct rbh_backend *source;
+    struct stat statbuf;
+    char *local;
+    bool complete;
+    char *uri;
+    int rc;
+
+    local = item_local_path(tree, path);
+    rc = lstat(local, &statbuf);
+    if (rc && errno != ENOENT && errno != ENOTDIR)
+        error(EXIT_FAILURE, errno, "lstat: %s", local);
+    free(local);
+    if (rc)
+        return true;
+
+    uri = item_uri(tree, path);
+    if (uri == NULL)
+        error(EXIT_FAILURE, errno, "item_uri");
+
+    source = rbh_backend_from_uri(uri);
+    fsentries = rbh_backend_filter(source, NULL, &source_options);
+    if (fsentries == NULL) {
+        /* Removed in the meantime */
+        if (errno != ENOENT)
+            error(EXIT_FAILURE, errno, "rbh_backend_filter_fsentries");
+        complete = true;
+    } else {
+        complete = sync_fsentries(to, fsentries, tree->projection);
+    }
+    rbh_backend_destroy(source);
+    free(uri);
+    return complete;
+}
+
+/* Claim an item, process it, and mark it as done.
+ *
+ * Returns false when there is nothing left to do.
+ */
+static bool
+process_next_item(struct coordination *coordination)
+{
+    struct queue *queue = &coordination->queue;
+    char **subdirs = NULL;
+    struct item *item;
+    size_t count = 0;
+    bool pending;
+    bool split;
+    time_t now;
+
+    queue_lock(queue, F_WRLCK);
+    queue_load(queue);
+
+    now = time(NULL);
+    pending = false;
+    item = NULL;
+    for (size_t i = 0; i < queue->count; i++) {
+        struct item *candidate = &queue->items[i];
+
+        if (candidate->state == IS_TODO
+         || (candidate->state == IS_CLAIMED && candidate->expiry <= now)) {
+            item = candidate;
+            break;
+        }
+        if (candidate->state == IS_CLAIMED)
+            pending = true;
+    }
+
+    if (item == NULL) {
+        queue_lock(queue, F_UNLCK);
+        /* Whoever holds the pending items may still split them */
+        if (pending)
+            sleep(1);
+        return pending;
+    }
+
+    item->state = IS_CLAIMED;
+    item->expiry = now + RBH_COORDINATE_LEASE;
+    free(item->owner);
+    item->owner = strdup(coordination->owner);
+    if (item->owner == NULL)
+        error(EXIT_FAILURE, errno, "strdup");
+    queue_store(queue);
+
+    lease.queue = queue;
+    lease.owner = coordination->owner;
+    lease.tree = item->tree;
+    lease.path = strdup(item->path);
+    lease.renewed = now;
+    if (lease.path == NULL)
+        error(EXIT_FAILURE, errno, "strdup");
+    queue_lock(queue, F_UNLCK);
+
+    split = lease.tree && is_worth_splitting(&coordination->tree, lease.path);
+    if (split)
+        subdirs = list_children(&coordination->tree, lease.path, true, &count);
+    else if (lease.tree)
+        process_tree(&coordination->tree, lease.path);
+    else
+        process_one(&coordination->tree, lease.path);
+
+    queue_lock(queue, F_WRLCK);
+    queue_load(queue);
+    if (split) {
+        queue_push(queue, IS_TODO, 0, "-", false, lease.path);
+        for (size_t i = 0; i < count; i++) {
+            queue_push(queue, IS_TODO, 0, "-", true, subdirs[i]);
+            free(subdirs[i]);
+        }
+        free(subdirs);
+    }
+    item = queue_find(queue, lease.tree, lease.path);
+    if (item) {
+        item->state = IS_DONE;
+        item->expiry = 0;
+    }
+    queue_store(queue);
+    queue_lock(queue, F_UNLCK);
+
+    free((char *)lease.path);
+    lease.queue = NULL;
+    return true;
+}
+
+static void
+sync_coordinated(const char *filename, const char *source,
+                 const struct rbh_filter_projection *projection)
+{
+    struct coordination coordination = {
+        .queue = {
+            .filename = filename,
+        },
+    };
+    char host[HOST_NAME_MAX + 1];
+
+    local_tree_init(&coordination.tree, source, projection, "--coordinate");
+
+    if (gethostname(host, sizeof(host)))
+        error(EXIT_FAILURE, errno, "gethostname");
+    host[sizeof(host) - 1] = '\0';
+    snprintf(coordination.owner, sizeof(coordination.owner), "%s:%d", host,
+             getpid());
+
+    coordination.queue.fd = open(filename, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (coordination.queue.fd < 0)
+        error(EXIT_FAILURE, errno, "open: %s", filename);
+
+    queue_lock(&coordination.queue, F_WRLCK);
+    queue_load(&coordination.queue);
+    if (coordination.queue.count == 0) {
+        queue_push(&coordination.queue, IS_TODO, 0, "-", true,
+                   coordination.tree.seed);
+        queue_store(&coordination.queue);
+    }
+    queue_lock(&coordination.queue, F_UNLCK);
+
+    while (process_next_item(&coordination));
+
+    queue_clear(&coordination.queue);
+    free(coordination.queue.items);
+    close(coordination.queue.fd);
+    local_tree_fini(&coordination.tree);
+}
+
+/*----------------------------------------------------------------------------*
+ |                             sync_prioritized()                             |
+ *----------------------------------------------------------------------------*/
+
+/* When the sync must be over by a deadline, SOURCE's root and its children
+ * which are not directories are synced first. Then, each subdirectory of the
+ * root is synced as a whole, the most recently modified first, so that DEST is
+ * freshest where users are actually working.
+ *
+ * Once the deadline has passed, the subtrees which were not (entirely) synced
+ * are printed on stdout, one URI per line, for the next run to start with.
+ */
+
+struct subtree {
+    char *path;
+    struct rbh_statx_timestamp mtime;
+};
+
+static int
+subtree_compare(const void *_lhs, const void *_rhs)
+{
+    const struct subtree *lhs = _lhs;
+    const struct subtree *rhs = _rhs;
+
+    /* Most recently modified first */
+    if (lhs->mtime.tv_sec != rhs->mtime.tv_sec)
+        return lhs->mtime.tv_sec < rhs->mtime.tv_sec ? 1 : -1;
+    if (lhs->mtime.tv_nsec != rhs->mtime.tv_nsec)
+        return lhs->mtime.tv_nsec < rhs->mtime.tv_nsec ? 1 : -1;
+    return 0;
+}
+
+/* Fetch the mtime of `subtree''s root.
+ *
+ * Returns false if the subtree does not exist anymore.
+ */
+static bool
+subtree_stat(const struct local_tree *tree, struct subtree *subtree)
+{
+    const struct rbh_filter_projection projection = {
+        .fsentry_mask = RBH_FP_STATX,
+        .statx_mask = RBH_STATX_MTIME_SEC | RBH_STATX_MTIME_NSEC,
+    };
+    struct rbh_backend *backend;
+    struct rbh_fsentry *root;
+    int save_errno;
+    char *uri;
+
+    uri = item_uri(tree, subtree->path);
+    if (uri == NULL)
+        error(EXIT_FAILURE, errno, "item_uri");
+
+    backend = rbh_backend_from_uri(uri);
+    root = rbh_backend_root(backend, &projection);
+    save_errno = errno;
+    rbh_backend_destroy(backend);
+
+    if (root == NULL && save_errno != ENOENT)
+        error(EXIT_FAILURE, save_errno, "rbh_backend_root: %s", uri);
+    free(uri);
+    if (root == NULL)
+        return false;
+
+    if ((root->mask & RBH_FP_STATX)
+     && (root->statx->stx_mask & RBH_STATX_MTIME_SEC))
+        subtree->mtime = root->statx->stx_mtime;
+    else
+        /* Unknown, sync it last */
+        subtree->mtime = (struct rbh_statx_timestamp){};
+    free(root);
+    return true;
+}
+
+/* Returns false if the deadline passed before everything was synced */
+static bool
+sync_prioritized(const char *source,
+                 const struct rbh_filter_projection *projection)
+{
+    struct subtree *subtrees;
+    struct local_tree tree;
+    size_t count, synced;
+    size_t kept = 0;
+    bool complete;
+    char **subdirs;
+
+    local_tree_init(&tree, source, projection, "--deadline");
+
+    /* Cheap first pass: list the root's subdirectories and their mtime */
+    subdirs = list_children(&tree, tree.seed, true, &count);
+    subtrees = reallocarray(NULL, count, sizeof(*subtrees));
+    if (subtrees == NULL && count > 0)
+        error(EXIT_FAILURE, errno, "reallocarray");
+
+    for (size_t i = 0; i < count; i++) {
+        subtrees[kept].path = subdirs[i];
+        if (subtree_stat(&tree, &subtrees[kept]))
+            kept++;
+        else
+            free(subdirs[i]);
+    }
+    free(subdirs);
+    count = kept;
+
+    qsort(subtrees, count, sizeof(*subtrees), subtree_compare);
+
+    if (!process_one(&tree, tree.seed)) {
+        /* Not even the root was synced, SOURCE as a whole is stale */
+        printf("%s\n", source);
+        complete = false;
+        synced = 0;
+    } else {
+        for (synced = 0; synced < count; synced++) {
+            if (time(NULL) >= deadline
+             || !process_tree(&tree, subtrees[synced].path))
+                break;
+        }
+
+        for (size_t i = synced; i < count; i++) {
+            char *uri = item_uri(&tree, subtrees[i].path);
+
+            if (uri == NULL)
+                error(EXIT_FAILURE, errno, "item_uri");
+            printf("%s\n", uri);
+            free(uri);
+        }
+        complete = synced == count;
+    }
+
+    if (!complete)
+        error(0, 0, "deadline reached, %zu out of %zu subtrees left stale",
+              count - synced, count);
+
+    for (size_t i = 0; i < count; i++)
+        free(subtrees[i].path);
+    free(subtrees);
+    local_tree_fini(&tree);
+
+    return complete;
+}
+
+/*----------------------------------------------------------------------------*
+ |                               sync_rescan()                                |
+ *----------------------------------------------------------------------------*/
+
+/* Entries modified while rbh-sync was reading SOURCE may have been missed, or
+ * read in an inconsistent state. Rather than syncing SOURCE all over again, a
+ * rescan only re-reads the entries whose ctime is more recent than the start
+ * of the previous pass, and repeats until a pass finds almost nothing.
+ *
+ * Filtering on ctime alone is enough: whatever changes a directory's mtime
+ * (creating, renaming or removing one of its entries) also changes its ctime,
+ * and new or renamed entries get a new ctime themselves.
+ *
+ * Backends which cannot filter (eg. posix) are not read all over again: only
+ * their directories are walked, and only the entries of the directories whose
+ * content changed are re-read. Entries that were modified in place, in a
+ * directory whose content did not change, are therefore left for the next sync.
+ */
+
+#ifndef RBH_RESCAN_MAX_PASSES
+# define RBH_RESCAN_MAX_PASSES 8
+#endif
+
+/* Stop as soon as a pass finds that many entries or less */
+#ifndef RBH_RESCAN_THRESHOLD
+# define RBH_RESCAN_THRESHOLD 64
+#endif
+
+/* Tolerated clock skew between rbh-sync and SOURCE (in seconds) */
+#ifndef RBH_RESCAN_SLACK
+# define RBH_RESCAN_SLACK 2
+#endif
+
+static bool rescan = false;
+
+    /*--------------------------------------------------------------------*
+     |                          iter_changed()                            |
+     *--------------------------------------------------------------------*/
+
+/* A changed_iterator filters out fsentries whose ctime is older than `since',
+ * for backends which cannot filter them out themselves (eg. posix), and counts
+ * the remaining ones.
+ */
+struct changed_iterator {
+    struct rbh_mut_iterator iterator;
+    struct rbh_mut_iterator *fsentries;
+    int64_t since;
+    size_t *count;
+};
+
+static void *
+changed_iter_next(void *iterator)
+{
+    struct changed_iterator *changed = iterator;
+    struct rbh_fsentry *fsentry;
+
+    while ((fsentry = rbh_mut_iter_next(changed->fsentries)) != NULL) {
+        /* Entries whose ctime is unknown may have changed */
+        if (!(fsentry->mask & RBH_FP_STATX)
+         || !(fsentry->statx->stx_mask & RBH_STATX_CTIME_SEC)
+         || fsentry->statx->stx_ctime.tv_sec >= changed->since) {
+            (*changed->count)++;
+            return fsentry;
+        }
+        free(fsentry);
+    }
+
+    return NULL;
+}
+
+static void
+changed_iter_destroy(void *iterator)
+{
+    struct changed_iterator *changed = iterator;
+
+    rbh_mut_iter_destroy(changed->fsentries);
+    free(changed);
+}
+
+static const struct rbh_mut_iterator_operations CHANGED_ITER_OPS = {
+    .next = changed_iter_next,
+    .destroy = changed_iter_destroy,
+};
+
+static const struct rbh_mut_iterator CHANGED_ITERATOR = {
+    .ops = &CHANGED_ITER_OPS,
+};
+
+static struct rbh_mut_iterator *
+iter_changed(struct rbh_mut_iterator *fsentries, int64_t since, size_t *count)
+{
+    struct changed_iterator *changed;
+
+    changed = malloc(sizeof(*changed));
+    if (changed == NULL)
+        error(EXIT_FAILURE, errno, "malloc");
+
+    changed->iterator = CHANGED_ITERATOR;
+    changed->fsentries = fsentries;
+    changed->since = since;
+    changed->count = count;
+    return &changed->iterator;
+}
+
+    /*--------------------------------------------------------------------*
+     |                        changed directories                         |
+     *--------------------------------------------------------------------*/
+
+/* Whether `path' is a directory whose mtime or ctime is `since' or later */
+static bool
+is_changed_directory(const struct local_tree *tree, const char *path,
+                     int64_t since)
+{
+    struct stat statbuf;
+    char *local;
+    int rc;
+
+    local = item_local_path(tree, path);
+    rc = lstat(local, &statbuf);
+    if (rc && errno != ENOENT && errno != ENOTDIR)
+        error(EXIT_FAILURE, errno, "lstat: %s", local);
+    free(local);
+
+    return rc == 0 && S_ISDIR(statbuf.st_mode)
+        && (statbuf.st_mtim.tv_sec >= since || statbuf.st_ctim.tv_sec >= since);
+}
+
+/* Sync the entries directly under `path' which changed after `since', then do
+ * the same for each of its subdirectories.
+ *
+ * Only the entries of directories whose content changed are re-read, but every
+ * subdirectory is walked down: a directory's mtime only reflects changes to its
+ * direct entries.
+ *
+ * Returns the number of entries that changed.
+ */
+static size_t
+sync_changed_directory(const struct local_tree *tree, const char *path,
+                       int64_t since)
+{
+    size_t files, subdirs, count = 0;
+    char **directories;
+
+    directories = list_children(tree, path, true, &subdirs);
+
+    if (is_changed_directory(tree, path, since)) {
+        char **children;
+
+        children = list_children(tree, path, false, &files);
+        children = reallocarray(children, files + subdirs, sizeof(*children));
+        if (children == NULL && files + subdirs > 0)
+            error(EXIT_FAILURE, errno, "reallocarray");
+
+        for (size_t i = 0; i < subdirs; i++) {
+            children[files + i] = strdup(directories[i]);
+            if (children[files + i] == NULL)
+                error(EXIT_FAILURE, errno, "strdup");
+        }
+
+        sync_fsentries(to, iter_changed(iter_children(tree, path, false,
+                                                      children, files + subdirs,
+                                                      since),
+                                        since, &count),
+                       tree->projection);
+    }
+
+    for (size_t i = 0; i < subdirs; i++) {
+        count += sync_changed_directory(tree, directories[i], since);
+        free(directories[i]);
+    }
+    free(directories);
+
+    return count;
+}
+
+    /*--------------------------------------------------------------------*
+     |                            rescan pass                             |
+     *--------------------------------------------------------------------*/
+
+/* Sync the entries of `source' which changed after `since'.
+ *
+ * Returns the number of such entries.
+ */
+static size_t
+sync_changed(const char *source, int64_t since,
+             const struct rbh_filter_projection *projection)
+{
+    const struct rbh_filter CHANGED = {
+        .op = RBH_FOP_GREATER_OR_EQUAL,
+        .compare = {
+            .field = {
+                .fsentry = RBH_FP_STATX,
+                .statx = RBH_STATX_CTIME_SEC,
+            },
+            .value = {
+                .type = RBH_VT_INT64,
+                .int64 = since,
+            },
+        },
+    };
+    struct rbh_mut_iterator *fsentries;
+    struct local_tree tree;
+    size_t count = 0;
+
+    if (one) {
+        sync_fsentries(to, iter_changed(source_fsentries(from, true), since,
+                                        &count),
+                       projection);
+        return count;
+    }
+
+    fsentries = rbh_backend_filter(from, &CHANGED, &source_options);
+    if (fsentries != NULL) {
+        sync_fsentries(to, iter_changed(fsentries, since, &count), projection);
+        return count;
+    }
+    if (errno != ENOTSUP)
+        error(EXIT_FAILURE, errno, "rbh_backend_filter_fsentries");
+
+    /* Walk SOURCE's directories, and only re-read the entries of those that
+     * changed
+     */
+    local_tree_init(&tree, source, projection, "--rescan");
+    sync_fsentries(to, iter_changed(source_fsentries(from, true), since,
+                                    &count),
+                   projection);
+    count += sync_changed_directory(&tree, tree.seed, since);
+    local_tree_fini(&tree);
+
+    return count;
+}
+
+/* `start' is the time at which the initial sync started */
+static void
+sync_rescan(const char *source, time_t start,
+            const struct rbh_filter_projection *projection)
+{
+    for (size_t pass = 0; pass < RBH_RESCAN_MAX_PASSES; pass++) {
+        time_t pass_start = time(NULL);
+
+        if (sync_changed(source, start - RBH_RESCAN_SLACK, projection)
+                <= RBH_RESCAN_THRESHOLD)
+            break;
+
+        start = pass_start;
+    }
+}
+
+#ifdef HAVE_MONGOC
+
+/*----------------------------------------------------------------------------*
+ |                             sync_server_side()                             |
+ *----------------------------------------------------------------------------*/
+
+/* When both SOURCE and DEST are whole databases of the mongo deployment, there
+ * is no need to stream every document through rbh-sync: the server can project
+ * and merge them itself, with a single aggregation pipeline.
+ */
+
+static const struct {
+    uint32_t mask;
+    const char *field;
+} STATX_FIELDS[] = {
+    { RBH_STATX_TYPE,           "statx.type" },
+    { RBH_STATX_MODE,           "statx.mode" },
+    { RBH_STATX_NLINK,          "statx.nlink" },
+    { RBH_STATX_UID,            "statx.uid" },
+    { RBH_STATX_GID,            "statx.gid" },
+    { RBH_STATX_ATIME_SEC,      "statx.atime.sec" },
+    { RBH_STATX_ATIME_NSEC,     "statx.atime.nsec" },
+    { RBH_STATX_BTIME_SEC,      "statx.btime.sec" },
+    { RBH_STATX_BTIME_NSEC,     "statx.btime.nsec" },
+    { RBH_STATX_CTIME_SEC,      "statx.ctime.sec" },
+    { RBH_STATX_CTIME_NSEC,     "statx.ctime.nsec" },
+    { RBH_STATX_MTIME_SEC,      "statx.mtime.sec" },
+    { RBH_STATX_MTIME_NSEC,     "statx.mtime.nsec" },
+    { RBH_STATX_INO,            "statx.ino" },
+    { RBH_STATX_SIZE,           "statx.size" },
+    { RBH_STATX_BLOCKS,         "statx.blocks" },
+    { RBH_STATX_BLKSIZE,        "statx.blksize" },
+    { RBH_STATX_ATTRIBUTES,     "statx.attributes" },
+    { RBH_STATX_RDEV_MAJOR,     "statx.rdev.major" },
+    { RBH_STATX_RDEV_MINOR,     "statx.rdev.minor" },
+    { RBH_STATX_DEV_MAJOR,      "statx.dev.major" },
+    { RBH_STATX_DEV_MINOR,      "statx.dev.minor" },
+};
+
+/* Only projections that map onto whole documents' fields can be expressed */
+static bool
+projection_is_server_side(const struct rbh_filter_projection *projection)
+{
+    uint32_t statx_mask = 0;
+    bool link;
+
+    if (!(projection->fsentry_mask & RBH_FP_ID))
+        return false;
+
+    link = (projection->fsentry_mask & RBH_FP_PARENT_ID)
+        && (projection->fsentry_mask & RBH_FP_NAME);
+    if (!link && (projection->fsentry_mask & (RBH_FP_PARENT_ID | RBH_FP_NAME
+                                              | RBH_FP_NAMESPACE_XATTRS)))
+        return false;
+
+    if (!(projection->fsentry_mask & RBH_FP_STATX))
+        return true;
+
+    for (size_t i = 0; i < sizeof(STATX_FIELDS) / sizeof(*STATX_FIELDS); i++)
+        statx_mask |= STATX_FIELDS[i].mask;
+
+    /* Some fields (eg. mount-id) cannot be projected server-side */
+    return !(projection->statx_mask & ~statx_mask);
+}
+
+static void
+bson_append_project(bson_t *stage,
+                    const struct rbh_filter_projection *projection)
+{
+    bson_t project;
+
+    BSON_APPEND_DOCUMENT_BEGIN(stage, "$project", &project);
+    if (projection->fsentry_mask & RBH_FP_PARENT_ID) {
+        BSON_APPEND_INT32(&project, "ns.parent", 1);
+        BSON_APPEND_INT32(&project, "ns.name", 1);
+        if (projection->fsentry_mask & RBH_FP_NAMESPACE_XATTRS)
+            BSON_APPEND_INT32(&project, "ns.xattrs", 1);
+    }
+    if (projection->fsentry_mask & RBH_FP_INODE_XATTRS)
+        BSON_APPEND_INT32(&project, "xattrs", 1);
+    if (projection->fsentry_mask & RBH_FP_SYMLINK)
+        BSON_APPEND_INT32(&project, "symlink", 1);
+    if (projection->fsentry_mask & RBH_FP_STATX) {
+        for (size_t i = 0; i < sizeof(STATX_FIELDS) / sizeof(*STATX_FIELDS);
+             i++) {
+            if (projection->statx_mask & STATX_FIELDS[i].mask)
+                BSON_APPEND_INT32(&project, STATX_FIELDS[i].field, 1);
+        }
+    }
+    /* `_id' is projected by default, make sure there is at least one field */
+    if (!(projection->fsentry_mask & ~RBH_FP_ID))
+        BSON_APPEND_INT32(&project, "_id", 1);
+    bson_append_document_end(stage, &project);
+}
+
+/* Append `{ $mergeObjects: [ "$<field>", "$$new.<field>" ] }' */
+static void
+bson_append_merge_objects(bson_t *set, const char *field)
+{
+    char old[32], new[32];
+    bson_t merge, array;
+
+    snprintf(old, sizeof(old), "$%s", field);
+    snprintf(new, sizeof(new), "$$new.%s", field);
+
+    BSON_APPEND_DOCUMENT_BEGIN(set, field, &merge);
+    BSON_APPEND_ARRAY_BEGIN(&merge, "$mergeObjects", &array);
+    BSON_APPEND_UTF8(&array, "0", old);
+    BSON_APPEND_UTF8(&array, "1", new);
+    bson_append_array_end(&merge, &array);
+    bson_append_document_end(set, &merge);
+}
+
+/* Append `{ $ifNull: [ "<field>", [] ] }' */
+static void
+bson_append_array_or_empty(bson_t *bson, const char *key, const char *field)
+{
+    bson_t if_null, args, empty;
+
+    BSON_APPEND_DOCUMENT_BEGIN(bson, key, &if_null);
+    BSON_APPEND_ARRAY_BEGIN(&if_null, "$ifNull", &args);
+    BSON_APPEND_UTF8(&args, "0", field);
+    BSON_APPEND_ARRAY_BEGIN(&args, "1", &empty);
+    bson_append_array_end(&args, &empty);
+    bson_append_array_end(&if_null, &args);
+    bson_append_document_end(bson, &if_null);
+}
+
+/* Append `{ parent: "$$<variable>.parent", name: "$$<variable>.name" }' */
+static void
+bson_append_link_key(bson_t *bson, const char *key, const char *variable)
+{
+    char parent[32], name[32];
+    bson_t link;
+
+    snprintf(parent, sizeof(parent), "$$%s.parent", variable);
+    snprintf(name, sizeof(name), "$$%s.name", variable);
+
+    BSON_APPEND_DOCUMENT_BEGIN(bson, key, &link);
+    BSON_APPEND_UTF8(&link, "parent", parent);
+    BSON_APPEND_UTF8(&link, "name", name);
+    bson_append_document_end(bson, &link);
+}
+
+/* Append the links of both the existing and the new document, those of the
+ * new document replacing existing ones with the same parent and name:
+ *
+ *     { $concatArrays: [
+ *         { $filter: {
+ *             input: { $ifNull: [ "$ns", [] ] },
+ *             as: "old",
+ *             cond: { $not: [ { $in: [
+ *                 { parent: "$$old.parent", name: "$$old.name" },
+ *                 { $map: {
+ *                     input: { $ifNull: [ "$$new.ns", [] ] },
+ *                     as: "link",
+ *                     in: { parent: "$$link.parent", name: "$$link.name" }
+ *                 } }
+ *             ] } ] }
+ *         } },
+ *         { $ifNull: [ "$$new.ns", [] ] }
+ *     ] }
+ */
+static void
+bson_append_merge_links(bson_t *set)
+{
+    bson_t ns, concat, filter, filter_args, cond, not, in, in_args, map,
+           map_args;
+
+    BSON_APPEND_DOCUMENT_BEGIN(set, "ns", &ns);
+    BSON_APPEND_ARRAY_BEGIN(&ns, "$concatArrays", &concat);
+
+    BSON_APPEND_DOCUMENT_BEGIN(&concat, "0", &filter);
+    BSON_APPEND_DOCUMENT_BEGIN(&filter, "$filter", &filter_args);
+    bson_append_array_or_empty(&filter_args, "input", "$ns");
+    BSON_APPEND_UTF8(&filter_args, "as", "old");
+
+    BSON_APPEND_DOCUMENT_BEGIN(&filter_args, "cond", &cond);
+    BSON_APPEND_ARRAY_BEGIN(&cond, "$not", &not);
+    BSON_APPEND_DOCUMENT_BEGIN(&not, "0", &in);
+    BSON_APPEND_ARRAY_BEGIN(&in, "$in", &in_args);
+    bson_append_link_key(&in_args, "0", "old");
+
+    BSON_APPEND_DOCUMENT_BEGIN(&in_args, "1", &map);
+    BSON_APPEND_DOCUMENT_BEGIN(&map, "$map", &map_args);
+    bson_append_array_or_empty(&map_args, "input", "$$new.ns");
+    BSON_APPEND_UTF8(&map_args, "as", "link");
+    bson_append_link_key(&map_args, "in", "link");
+    bson_append_document_end(&map, &map_args);
+    bson_append_document_end(&in_args, &map);
+
+    bson_append_array_end(&in, &in_args);
+    bson_append_document_end(&not, &in);
+    bson_append_array_end(&cond, &not);
+    bson_append_document_end(&filter_args, &cond);
+
+    bson_append_document_end(&filter, &filter_args);
+    bson_append_document_end(&concat, &filter);
+
+    bson_append_array_or_empty(&concat, "1", "$$new.ns");
+
+    bson_append_array_end(&ns, &concat);
+    bson_append_document_end(set, &ns);
+}
+
+/* Documents already in DEST are updated the way the streaming path would:
+ * links are added to existing ones (or replace them if they have the same
+ * parent and name), statx and xattrs are merged field by field and the symlink
+ * is overwritten.
+ */
+static void
+bson_append_when_matched(bson_t *merge,
+                         const struct rbh_filter_projection *projection)
+{
+    bson_t pipeline, stage, set;
+
+    /* There is nothing to update, besides `_id' */
+    if (!(projection->fsentry_mask & ~RBH_FP_ID)) {
+        BSON_APPEND_UTF8(merge, "whenMatched", "keepExisting");
+        return;
+    }
+
+    BSON_APPEND_ARRAY_BEGIN(merge, "whenMatched", &pipeline);
+    BSON_APPEND_DOCUMENT_BEGIN(&pipeline, "0", &stage);
+    BSON_APPEND_DOCUMENT_BEGIN(&stage, "$set", &set);
+
+    if (projection->fsentry_mask & RBH_FP_PARENT_ID)
+        bson_append_merge_links(&set);
+
+    if (projection->fsentry_mask & RBH_FP_INODE_XATTRS)
+        bson_append_merge_objects(&set, "xattrs");
+
+    if (projection->fsentry_mask & RBH_FP_STATX)
+        bson_append_merge_objects(&set, "statx");
+
+    if (projection->fsentry_mask & RBH_FP_SYMLINK) {
+        bson_t symlink, args;
+
+        BSON_APPEND_DOCUMENT_BEGIN(&set, "symlink", &symlink);
+        BSON_APPEND_ARRAY_BEGIN(&symlink, "$ifNull", &args);
+        BSON_APPEND_UTF8(&args, "0", "$$new.symlink");
+        BSON_APPEND_UTF8(&args, "1", "$symlink");
+        bson_append_array_end(&symlink, &args);
+        bson_append_document_end(&set, &symlink);
+    }
+
+    bson_append_document_end(&stage, &set);
+    bson_append_document_end(&pipeline, &stage);
+    bson_append_array_end(merge, &pipeline);
+}
+
+static void
+bson_append_merge(bson_t *stage, const char *database,
+                  const struct rbh_filter_projection *projection)
+{
+    bson_t merge, into;
+
+    BSON_APPEND_DOCUMENT_BEGIN(stage, "$merge", &merge);
+    BSON_APPEND_DOCUMENT_BEGIN(&merge, "into", &into);
+    BSON_APPEND_UTF8(&into, "db", database);
+    BSON_APPEND_UTF8(&into, "coll", "entries");
+    bson_append_document_end(&merge, &into);
+    BSON_APPEND_UTF8(&merge, "on", "_id");
+    bson_append_when_matched(&merge, projection);
+    BSON_APPEND_UTF8(&merge, "whenNotMatched", "insert");
+    bson_append_document_end(stage, &merge);
+}
+
+/* Returns true if the sync was performed server-side, false if the caller
+ * should fall back to streaming SOURCE's entries.
+ */
+static bool
+sync_server_side(const char *source, const char *dest,
+                 const struct rbh_filter_projection *projection)
+{
+    struct rbh_uri *from_uri = NULL, *to_uri = NULL;
+    mongoc_collection_t *collection;
+    mongoc_cursor_t *cursor;
+    bson_t pipeline, stage;
+    bson_error_t error_;
+    const bson_t *doc;
+    bool done = false;
+
+    /* The server cannot apply the xattr policy */
+    if (one || !projection_is_server_side(projection) || xattr_policy_enabled())
+        return false;
+
+    from_uri = uri_from_string(source);
+    to_uri = uri_from_string(dest);
+    if (from_uri == NULL || to_uri == NULL)
+        goto out;
+
+    if (strcmp(from_uri->backend, "mongo") || strcmp(to_uri->backend, "mongo"))
+        goto out;
+    if (from_uri->type != RBH_UT_BARE || to_uri->type != RBH_UT_BARE)
+        goto out;
+    if (strcmp(from_uri->fsname, to_uri->fsname) == 0)
+        goto out;
+
+    bson_init(&pipeline);
+    BSON_APPEND_DOCUMENT_BEGIN(&pipeline, "0", &stage);
+    bson_append_project(&stage, projection);
+    bson_append_document_end(&pipeline, &stage);
+    BSON_APPEND_DOCUMENT_BEGIN(&pipeline, "1", &stage);
+    bson_append_merge(&stage, to_uri->fsname, projection);
+    bson_append_document_end(&pipeline, &stage);
+
+    collection = mongoc_client_get_collection(mongo_client(), from_uri->fsname,
+                                              "entries");
+    cursor = mongoc_collection_aggregate(collection, MONGOC_QUERY_NONE,
+                                         &pipeline, NULL, NULL);
+    /* `$merge' does not return any document */
+    while (mongoc_cursor_next(cursor, &doc));
+
+    /* Whatever was merged is still valid, streaming will complete it */
+    if (mongoc_cursor_error(cursor, &error_))
+        error(0, 0, "server-side sync failed, falling back to streaming: %s",
+              error_.message);
+    else
+        done = true;
+
+    mongoc_cursor_destroy(cursor);
+    mongoc_collection_destroy(collection);
+    bson_destroy(&pipeline);
+out:
+    free(to_uri);
+    free(from_uri);
+    return done;
+}
+
+/*----------------------------------------------------------------------------*
+ |                              sync_parallel()                               |
+ *----------------------------------------------------------------------------*/
+
+/* A single cursor cannot read a mongo backend as fast as the server can serve
+ * it. Instead, SOURCE is split into disjoint ranges of `_id's, each of which is
+ * read, converted and upserted into DEST by its own thread, with its own
+ * backends.
+ */
+
+#ifndef RBH_SAMPLES_PER_RANGE
+# define RBH_SAMPLES_PER_RANGE 128
+#endif
+
+static bool
+id_equal(const struct rbh_id *first, const struct rbh_id *second)
+{
+    return first->size == second->size
+        && memcmp(first->data, second->data, first->size) == 0;
+}
+
+/* Sample `_id's out of `database' and pick up to `count' distinct boundaries
+ * that split it into ranges of similar sizes.
+ *
+ * Returns the number of boundaries found.
+ */
+static size_t
+sample_boundaries(const char *database, struct rbh_id *boundaries,
+                  size_t count)
+{
+    const size_t max_samples = (count + 1) * RBH_SAMPLES_PER_RANGE;
+    bson_t pipeline, stage, sample, project, sort;
+    mongoc_collection_t *collection;
+    size_t samples = 0, found = 0;
+    mongoc_cursor_t *cursor;
+    struct rbh_id *ids;
+    bson_error_t error_;
+    const bson_t *doc;
+
+    ids = calloc(max_samples, sizeof(*ids));
+    if (ids == NULL)
+        error(EXIT_FAILURE, errno, "calloc");
+
+    /* [ { $sample: { size: N } }, { $project: { _id: 1 } },
+     *   { $sort: { _id: 1 } } ]
+     */
+    bson_init(&pipeline);
+    BSON_APPEND_DOCUMENT_BEGIN(&pipeline, "0", &stage);
+    BSON_APPEND_DOCUMENT_BEGIN(&stage, "$sample", &sample);
+    BSON_APPEND_INT64(&sample, "size", max_samples);
+    bson_append_document_end(&stage, &sample);
+    bson_append_document_end(&pipeline, &stage);
+    BSON_APPEND_DOCUMENT_BEGIN(&pipeline, "1", &stage);
+    BSON_APPEND_DOCUMENT_BEGIN(&stage, "$project", &project);
+    BSON_APPEND_INT32(&project, "_id", 1);
+    bson_append_document_end(&stage, &project);
+    bson_append_document_end(&pipeline, &stage);
+    BSON_APPEND_DOCUMENT_BEGIN(&pipeline, "2", &stage);
+    BSON_APPEND_DOCUMENT_BEGIN(&stage, "$sort", &sort);
+    BSON_APPEND_INT32(&sort, "_id", 1);
+    bson_append_document_end(&stage, &sort);
+    bson_append_document_end(&pipeline, &stage);
+
+    collection = mongoc_client_get_collection(mongo_client(), database,
+                                              "entries");
+    cursor = mongoc_collection_aggregate(collection, MONGOC_QUERY_NONE,
+                                         &pipeline, NULL, NULL);
+    while (samples < max_samples && mongoc_cursor_next(cursor, &doc)) {
+        bson_subtype_t subtype;
+        const uint8_t *data;
+        bson_iter_t iter;
+        uint32_t size;
+        char *copy;
+
+        if (!bson_iter_init_find(&iter, doc, "_id")
+         || !BSON_ITER_HOLDS_BINARY(&iter))
+            continue;
+
+        bson_iter_binary(&iter, &subtype, &size, &data);
+        copy = malloc(size);
+        if (copy == NULL)
+            error(EXIT_FAILURE, errno, "malloc");
+        memcpy(copy, data, size);
+
+        ids[samples].data = copy;
+        ids[samples++].size = size;
+    }
+
+    if (mongoc_cursor_error(cursor, &error_))
+        error(EXIT_FAILURE, 0, "while sampling SOURCE: %s", error_.message);
+
+    mongoc_cursor_destroy(cursor);
+    mongoc_collection_destroy(collection);
+    bson_destroy(&pipeline);
+
+    /* Keep every (samples / (count + 1))th sample */
+    for (size_t i = 1; i <= count && samples > count; i++) {
+        struct rbh_id *id = &ids[i * samples / (count + 1)];
+
+        if (found && id_equal(&boundaries[found - 1], id))
+            continue;
+
+        boundaries[found++] = *id;
+        id->data = NULL;
+    }
+
+    for (size_t i = 0; i < samples; i++)
+        free((char *)ids[i].data);
+    free(ids);
+
+    return found;
+}
+
+/* `_id' in [lower, upper), where either bound may be missing */
+struct range {
+    pthread_t thread;
+    struct rbh_backend *from;
+    struct rbh_backend *to;
+    const struct rbh_filter_projection *projection;
+
+    struct rbh_filter filter;
+    struct rbh_filter bounds[2];
+    const struct rbh_filter *filters[2];
+};
+
+static void
+range_init(struct range *range, const struct rbh_id *lower,
+           const struct rbh_id *upper)
+{
+    size_t count = 0;
+
+    if (lower) {
+        range->bounds[count] = (struct rbh_filter){
+            .op = RBH_FOP_GREATER_OR_EQUAL,
+            .compare = {
+                .field = {
+                    .fsentry = RBH_FP_ID,
+                },
+                .value = {
+                    .type = RBH_VT_BINARY,
+                    .binary = {
+                        .data = lower->data,
+                        .size = lower->size,
+                    },
+                },
+            },
+        };
+        range->filters[count] = &range->bounds[count];
+        count++;
+    }
+
+    if (upper) {
+        range->bounds[count] = (struct rbh_filter){
+            .op = RBH_FOP_STRICTLY_LOWER,
+            .compare = {
+                .field = {
+                    .fsentry = RBH_FP_ID,
+                },
+                .value = {
+                    .type = RBH_VT_BINARY,
+                    .binary = {
+                        .data = upper->data,
+                        .size = upper->size,
+                    },
+                },
+            },
+        };
+        range->filters[count] = &range->bounds[count];
+        count++;
+    }
+
+    range->filter = (struct rbh_filter){
+        .op = RBH_FOP_AND,
+        .logical = {
+            .filters = range->filters,
+            .count = count,
+        },
+    };
+}
+
+static void *
+range_sync(void *data)
+{
+    struct range *range = data;
+    struct rbh_mut_iterator *fsentries;
+
+    fsentries = rbh_backend_filter(range->from, &range->filter,
+                                   &source_options);
+    if (fsentries == NULL)
+        error(EXIT_FAILURE, errno, "rbh_backend_filter_fsentries");
+
+    sync_fsentries(range->to, fsentries, range->projection);
+    return NULL;
+}
+
+/* Returns true if the sync was performed in parallel, false if the caller
+ * should fall back to using a single cursor.
+ */
+static bool
+sync_parallel(const char *source, const char *dest,
+              const struct rbh_filter_projection *projection)
+{
+    struct rbh_id *boundaries;
+    struct rbh_uri *uri;
+    struct range *ranges;
+    size_t count;
+
+    if (one || jobs < 2)
+        return false;
+
+    uri = uri_from_string(source);
+    if (uri == NULL)
+        return false;
+
+    if (strcmp(uri->backend, "mongo") || uri->type != RBH_UT_BARE) {
+        free(uri);
+        return false;
+    }
+
+    boundaries = calloc(jobs - 1, sizeof(*boundaries));
+    if (boundaries == NULL)
+        error(EXIT_FAILURE, errno, "calloc");
+
+    count = sample_boundaries(uri->fsname, boundaries, jobs - 1);
+    free(uri);
+    if (count == 0) {
+        /* SOURCE is too small to be worth splitting */
+        free(boundaries);
+        return false;
+    }
+
+    ranges = calloc(count + 1, sizeof(*ranges));
+    if (ranges == NULL)
+        error(EXIT_FAILURE, errno, "calloc");
+
+    for (size_t i = 0; i <= count; i++) {
+        range_init(&ranges[i], i > 0 ? &boundaries[i - 1] : NULL,
+                   i < count ? &boundaries[i] : NULL);
+        ranges[i].from = rbh_backend_from_uri(source);
+        ranges[i].to = rbh_backend_from_uri(dest);
+        ranges[i].projection = projection;
+    }
+
+    for (size_t i = 0; i <= count; i++) {
+        int rc;
+
+        rc = pthread_create(&ranges[i].thread, NULL, range_sync, &ranges[i]);
+        if (rc)
+            error(EXIT_FAILURE, rc, "pthread_create");
+    }
+
+    for (size_t i = 0; i <= count; i++) {
+        pthread_join(ranges[i].thread, NULL);
+        rbh_backend_destroy(ranges[i].from);
+        rbh_backend_destroy(ranges[i].to);
+    }
+    free(ranges);
+
+    for (size_t i = 0; i < count; i++)
+        free((char *)boundaries[i].data);
+    free(boundaries);
+
+    return true;
+}
+
+/*----------------------------------------------------------------------------*
+ |                            sync_initial_load()                             |
+ *----------------------------------------------------------------------------*/
+
+/* Loading an empty mongo backend through upserts is wasteful: every upsert has
+ * to look for a document that does not exist, and every secondary index is
+ * updated on every write.
+ *
+ * An initial load builds each fsentry's document in one go (inode and link),
+ * inserts it with unordered bulk inserts, and only builds secondary indexes
+ * once every document is in. Hardlinks, which show up as documents with an
+ * `_id' that was already inserted, are turned into link updates.
+ *
+ * Documents follow the layout of librobinhood's mongo backend.
+ */
+
+static void
+bson_append_rbh_id(bson_t *bson, const char *key, const struct rbh_id *id)
+{
+    bson_append_binary(bson, key, -1, BSON_SUBTYPE_BINARY,
+                       (const uint8_t *)id->data, id->size);
+}
+
+static void
+bson_append_value_map(bson_t *bson, const char *key,
+                      const struct rbh_value_map *map);
+
+static void
+bson_append_rbh_value(bson_t *bson, const char *key,
+                      const struct rbh_value *value)
+{
+    bson_t array;
+
+    switch (value->type) {
+    case RBH_VT_INT32:
+        BSON_APPEND_INT32(bson, key, value->int32);
+        break;
+    case RBH_VT_UINT32:
+        BSON_APPEND_INT32(bson, key, value->uint32);
+        break;
+    case RBH_VT_INT64:
+        BSON_APPEND_INT64(bson, key, value->int64);
+        break;
+    case RBH_VT_UINT64:
+        BSON_APPEND_INT64(bson, key, value->uint64);
+        break;
+    case RBH_VT_STRING:
+        BSON_APPEND_UTF8(bson, key, value->string);
+        break;
+    case RBH_VT_BINARY:
+        bson_append_binary(bson, key, -1, BSON_SUBTYPE_BINARY,
+                           (const uint8_t *)value->binary.data,
+                           value->binary.size);
+        break;
+    case RBH_VT_REGEX:
+        BSON_APPEND_REGEX(bson, key, value->regex.string,
+                          value->regex.options & RBH_RO_CASE_INSENSITIVE ?
+                            "i" : "");
+        break;
+    case RBH_VT_SEQUENCE:
+        BSON_APPEND_ARRAY_BEGIN(bson, key, &array);
+        for (size_t i = 0; i < value->sequence.count; i++) {
+            char index[16];
+
+            snprintf(index, sizeof(index), "%zu", i);
+            bson_append_rbh_value(&array, index, &value->sequence.values[i]);
+        }
+        bson_append_array_end(bson, &array);
+        break;
+    case RBH_VT_MAP:
+        bson_append_value_map(bson, key, &value->map);
+        break;
+    }
+}
+
+static void
+bson_append_value_map(bson_t *bson, const char *key,
+                      const struct rbh_value_map *map)
+{
+    bson_t document;
+
+    BSON_APPEND_DOCUMENT_BEGIN(bson, key, &document);
+    for (size_t i = 0; i < map->count; i++) {
+        const struct rbh_value_pair *pair = &map->pairs[i];
+
+        if (pair->value)
+            bson_append_rbh_value(&document, pair->key, pair->value);
+        else
+            BSON_APPEND_NULL(&document, pair->key);
+    }
+    bson_append_document_end(bson, &document);
+}
+
+static void
+bson_append_timestamp(bson_t *bson, const char *key, uint32_t mask,
+                      uint32_t sec, uint32_t nsec,
+                      const struct rbh_statx_timestamp *timestamp)
+{
+    bson_t document;
+
+    if (!(mask & (sec | nsec)))
+        return;
+
+    BSON_APPEND_DOCUMENT_BEGIN(bson, key, &document);
+    if (mask & sec)
+        BSON_APPEND_INT64(&document, "sec", timestamp->tv_sec);
+    if (mask & nsec)
+        BSON_APPEND_INT32(&document, "nsec", timestamp->tv_nsec);
+    bson_append_document_end(bson, &document);
+}
+
+static void
+bson_append_device(bson_t *bson, const char *key, uint32_t mask,
+                   uint32_t major_mask, uint32_t minor_mask,
+                   uint32_t major, uint32_t minor)
+{
+    bson_t document;
+
+    if (!(mask & (major_mask | minor_mask)))
+        return;
+
+    BSON_APPEND_DOCUMENT_BEGIN(bson, key, &document);
+    if (mask & major_mask)
+        BSON_APPEND_INT32(&document, "major", major);
+    if (mask & minor_mask)
+        BSON_APPEND_INT32(&document, "minor", minor);
+    bson_append_document_end(bson, &document);
+}
+
+static const struct {
+    uint64_t attribute;
+    const char *name;
+} STATX_ATTRIBUTES[] = {
+    { STATX_ATTR_COMPRESSED,    "compressed" },
+    { STATX_ATTR_IMMUTABLE,     "immutable" },
+    { STATX_ATTR_APPEND,        "append" },
+    { STATX_ATTR_NODUMP,        "nodump" },
+    { STATX_ATTR_ENCRYPTED,     "encrypted" },
+    { STATX_ATTR_AUTOMOUNT,     "automount" },
+#ifdef STATX_ATTR_MOUNT_ROOT
+    { STATX_ATTR_MOUNT_ROOT,    "mount-root" },
+#endif
+#ifdef STATX_ATTR_VERITY
+    { STATX_ATTR_VERITY,        "verity" },
+#endif
+#ifdef STATX_ATTR_DAX
+    { STATX_ATTR_DAX,           "dax" },
+#endif
+};
+
+static void
+bson_append_statx(bson_t *bson, const char *key, const struct rbh_statx *statx,
+                  uint32_t mask)
+{
+    bson_t document, attributes;
+
+    mask &= statx->stx_mask;
+
+    BSON_APPEND_DOCUMENT_BEGIN(bson, key, &document);
+    if (mask & RBH_STATX_TYPE)
+        BSON_APPEND_INT32(&document, "type", statx->stx_mode & S_IFMT);
+    if (mask & RBH_STATX_MODE)
+        BSON_APPEND_INT32(&document, "mode", statx->stx_mode & ~S_IFMT);
+    if (mask & RBH_STATX_NLINK)
+        BSON_APPEND_INT32(&document, "nlink", statx->stx_nlink);
+    if (mask & RBH_STATX_UID)
+        BSON_APPEND_INT32(&document, "uid", statx->stx_uid);
+    if (mask & RBH_STATX_GID)
+        BSON_APPEND_INT32(&document, "gid", statx->stx_gid);
+    bson_append_timestamp(&document, "atime", mask, RBH_STATX_ATIME_SEC,
+                          RBH_STATX_ATIME_NSEC, &statx->stx_atime);
+    bson_append_timestamp(&document, "btime", mask, RBH_STATX_BTIME_SEC,
+                          RBH_STATX_BTIME_NSEC, &statx->stx_btime);
+    bson_append_timestamp(&document, "ctime", mask, RBH_STATX_CTIME_SEC,
+                          RBH_STATX_CTIME_NSEC, &statx->stx_ctime);
+    bson_append_timestamp(&document, "mtime", mask, RBH_STATX_MTIME_SEC,
+                          RBH_STATX_MTIME_NSEC, &statx->stx_mtime);
+    if (mask & RBH_STATX_INO)
+        BSON_APPEND_INT64(&document, "ino", statx->stx_ino);
+    if (mask & RBH_STATX_SIZE)
+        BSON_APPEND_INT64(&document, "size", statx->stx_size);
+    if (mask & RBH_STATX_BLOCKS)
+        BSON_APPEND_INT64(&document, "blocks", statx->stx_blocks);
+    if (mask & RBH_STATX_BLKSIZE)
+        BSON_APPEND_INT32(&document, "blksize", statx->stx_blksize);
+    if (mask & RBH_STATX_ATTRIBUTES) {
+        BSON_APPEND_DOCUMENT_BEGIN(&document, "attributes", &attributes);
+        for (size_t i = 0;
+             i < sizeof(STATX_ATTRIBUTES) / sizeof(*STATX_ATTRIBUTES); i++) {
+            if (statx->stx_attributes_mask & STATX_ATTRIBUTES[i].attribute)
+                BSON_APPEND_BOOL(&attributes, STATX_ATTRIBUTES[i].name,
+                                 statx->stx_attributes
+                                     & STATX_ATTRIBUTES[i].attribute);
+        }
+        bson_append_document_end(&document, &attributes);
+    }
+    bson_append_device(&document, "rdev", mask, RBH_STATX_RDEV_MAJOR,
+                       RBH_STATX_RDEV_MINOR, statx->stx_rdev_major,
+                       statx->stx_rdev_minor);
+    bson_append_device(&document, "dev", mask, RBH_STATX_DEV_MAJOR,
+                       RBH_STATX_DEV_MINOR, statx->stx_dev_major,
+                       statx->stx_dev_minor);
+    if (mask & RBH_STATX_MNT_ID)
+        BSON_APPEND_INT64(&document, "mount-id", statx->stx_mnt_id);
+    bson_append_document_end(bson, &document);
+}
+
+/* The document an upsert and a link of `fsentry' would have produced.
+ *
+ * `scratch' is only used (and cleared) when there is an xattr policy to apply.
+ */
+static bson_t *
+bson_from_fsentry(const struct rbh_fsentry *fsentry,
+                  const struct rbh_filter_projection *projection,
+                  struct scratch *scratch)
+{
+    const uint32_t mask = fsentry->mask & projection->fsentry_mask;
+    struct rbh_value_map ns_xattrs = fsentry->xattrs.ns;
+    struct rbh_value_map inode_xattrs = fsentry->xattrs.inode;
+    bson_t *document;
+
+    if (scratch) {
+        size_t applied = 0;
+
+        scratch_clear(scratch);
+        if (mask & RBH_FP_NAMESPACE_XATTRS)
+            applied += xattr_policy_apply(&ns_xattrs, scratch, true);
+        if (mask & RBH_FP_INODE_XATTRS)
+            applied += xattr_policy_apply(&inode_xattrs, scratch, true);
+        if (applied)
+            xattr_policy_count_entry();
+    }
+
+    document = bson_new();
+    bson_append_rbh_id(document, "_id", &fsentry->id);
 
-    if (needs.symlink & has.symlink)
-        fsevent->upsert.symlink = fsentry->symlink;
-    else
-        fsevent->upsert.symlink = NULL;
+    if ((mask & RBH_FP_PARENT_ID) && (mask & RBH_FP_NAME)) {
+        bson_t ns, link;
 
-    return fsevent;
-}
+        BSON_APPEND_ARRAY_BEGIN(document, "ns", &ns);
+        BSON_APPEND_DOCUMENT_BEGIN(&ns, "0", &link);
+        bson_append_rbh_id(&link, "parent", &fsentry->parent_id);
+        BSON_APPEND_UTF8(&link, "name", fsentry->name);
+        if (mask & RBH_FP_NAMESPACE_XATTRS)
+            bson_append_value_map(&link, "xattrs", &ns_xattrs);
+        bson_append_document_end(&ns, &link);
+        bson_append_array_end(document, &ns);
+    }
 
-static struct rbh_fsevent *
-inode_xattr_from_fsentry(struct rbh_fsevent *fsevent,
-                         const struct rbh_fsentry *fsentry)
-{
-    fsevent->type = RBH_FET_XATTR;
-    assert(fsentry->mask & RBH_FP_ID);
-    fsevent->id = fsentry->id;
-    assert(fsentry->mask & RBH_FP_INODE_XATTRS);
-    fsevent->xattrs = fsentry->xattrs.inode;
+    if (mask & RBH_FP_SYMLINK)
+        BSON_APPEND_UTF8(document, "symlink", fsentry->symlink);
 
-    fsevent->ns.parent_id = NULL;
-    fsevent->ns.name = NULL;
+    if (mask & RBH_FP_STATX)
+        bson_append_statx(document, "statx", fsentry->statx,
+                          projection->statx_mask);
 
-    return fsevent;
+    if (mask & RBH_FP_INODE_XATTRS)
+        bson_append_value_map(document, "xattrs", &inode_xattrs);
+
+    return document;
 }
 
-static struct rbh_fsevent *
-link_from_fsentry(struct rbh_fsevent *fsevent,
-                  const struct rbh_fsentry *fsentry,
-                  const struct rbh_filter_projection *projection)
+/* MongoDB's error code for duplicate keys */
+#define MONGO_DUPLICATE_KEY 11000
+
+/* Turn the insertion of a document whose `_id' already exists into the
+ * addition of its link to the existing document
+ */
+static bool
+bulk_link_document(mongoc_bulk_operation_t *bulk, const bson_t *document)
 {
-    struct {
-        bool xattrs:1;
-    } has = {
-        .xattrs = fsentry->mask & RBH_FP_NAMESPACE_XATTRS,
-    }, needs = {
-        .xattrs = projection->fsentry_mask & RBH_FP_NAMESPACE_XATTRS,
-    };
+    bson_t selector, update, add_to_set, each;
+    bson_iter_t id, ns;
+    bson_error_t error_;
 
-    fsevent->type = RBH_FET_LINK;
-    assert(fsentry->mask & RBH_FP_ID);
-    fsevent->id = fsentry->id;
-    assert(fsentry->mask & RBH_FP_PARENT_ID);
-    fsevent->link.parent_id = &fsentry->parent_id;
-    assert(fsentry->mask & RBH_FP_NAME);
-    fsevent->link.name = fsentry->name;
+    if (!bson_iter_init_find(&id, document, "_id")
+     || !bson_iter_init_find(&ns, document, "ns"))
+        /* There is no link to add */
+        return false;
 
-    if (needs.xattrs & has.xattrs)
-        fsevent->xattrs = fsentry->xattrs.ns;
-    else
-        fsevent->xattrs.count = 0;
+    bson_init(&selector);
+    BSON_APPEND_ITER(&selector, "_id", &id);
 
-    return fsevent;
-}
+    /* { $addToSet: { ns: { $each: [ ... ] } } } */
+    bson_init(&update);
+    BSON_APPEND_DOCUMENT_BEGIN(&update, "$addToSet", &add_to_set);
+    BSON_APPEND_DOCUMENT_BEGIN(&add_to_set, "ns", &each);
+    BSON_APPEND_ITER(&each, "$each", &ns);
+    bson_append_document_end(&add_to_set, &each);
+    bson_append_document_end(&update, &add_to_set);
 
-static struct rbh_fsevent *
-ns_xattr_from_fsentry(struct rbh_fsevent *fsevent,
-                      const struct rbh_fsentry *fsentry)
-{
-    fsevent->type = RBH_FET_XATTR;
-    assert(fsentry->mask & RBH_FP_ID);
-    fsevent->id = fsentry->id;
-    assert(fsentry->mask & RBH_FP_PARENT_ID);
-    fsevent->link.parent_id = &fsentry->parent_id;
-    assert(fsentry->mask & RBH_FP_NAME);
-    fsevent->link.name = fsentry->name;
-    assert(fsentry->mask & RBH_FP_NAMESPACE_XATTRS);
-    fsevent->xattrs = fsentry->xattrs.ns;
+    if (!mongoc_bulk_operation_update_one_with_opts(bulk, &selector, &update,
+                                                    NULL, &error_))
+        error(EXIT_FAILURE, 0, "mongoc_bulk_operation_update_one: %s",
+              error_.message);
 
-    return fsevent;
+    bson_destroy(&update);
+    bson_destroy(&selector);
+    return true;
 }
 
-static const void *
-convert_iter_next(void *iterator)
+/* Insert `documents', then add the links of those which were duplicates */
+static void
+insert_documents(mongoc_collection_t *collection, bson_t **documents,
+                 size_t count)
 {
-    struct convert_iterator *convert = iterator;
+    mongoc_bulk_operation_t *bulk, *links;
+    bson_t opts, reply;
+    bson_iter_t iter, errors;
+    size_t updates = 0;
+    bson_error_t error_;
 
-    if (convert->todo.upsert) {
-        convert->todo.upsert = false;
-        return upsert_from_fsentry(&convert->fsevent, &convert->statx,
-                                   convert->fsentry, convert->projection);
-    }
+    bson_init(&opts);
+    BSON_APPEND_BOOL(&opts, "ordered", false);
 
-    if (convert->todo.inode_xattr) {
-        convert->todo.inode_xattr = false;
-        return inode_xattr_from_fsentry(&convert->fsevent, convert->fsentry);
+    bulk = mongoc_collection_create_bulk_operation_with_opts(collection,
+                                                             &opts);
+    for (size_t i = 0; i < count; i++) {
+        if (!mongoc_bulk_operation_insert_with_opts(bulk, documents[i], NULL,
+                                                    &error_))
+            error(EXIT_FAILURE, 0, "mongoc_bulk_operation_insert: %s",
+                  error_.message);
     }
 
-    if (convert->todo.link) {
-        convert->todo.link = false;
-        return link_from_fsentry(&convert->fsevent, convert->fsentry,
-                                 convert->projection);
+    if (mongoc_bulk_operation_execute(bulk, &reply, &error_)) {
+        bson_destroy(&reply);
+        goto out;
     }
 
-    if (convert->todo.ns_xattr) {
-        convert->todo.ns_xattr = false;
-        return ns_xattr_from_fsentry(&convert->fsevent, convert->fsentry);
-    }
+    if (!bson_iter_init_find(&iter, &reply, "writeErrors")
+     || !BSON_ITER_HOLDS_ARRAY(&iter))
+        error(EXIT_FAILURE, 0, "while inserting into DEST: %s",
+              error_.message);
 
-    if (_convert_iter_next(convert, convert->projection))
-        return NULL;
+    links = mongoc_collection_create_bulk_operation_with_opts(collection,
+                                                              &opts);
+    bson_iter_recurse(&iter, &errors);
+    while (bson_iter_next(&errors)) {
+        int32_t index = -1, code = -1;
+        bson_iter_t field;
 
-    return convert_iter_next(iterator);
-}
+        if (BSON_ITER_HOLDS_DOCUMENT(&errors)
+         && bson_iter_recurse(&errors, &field)) {
+            while (bson_iter_next(&field)) {
+                if (strcmp(bson_iter_key(&field), "index") == 0)
+                    index = bson_iter_int32(&field);
+                else if (strcmp(bson_iter_key(&field), "code") == 0)
+                    code = bson_iter_int32(&field);
+            }
+        }
 
-static void
-convert_iter_destroy(void *iterator) {
-    struct convert_iterator *convert = iterator;
+        if (code != MONGO_DUPLICATE_KEY || index < 0 || (size_t)index >= count)
+            error(EXIT_FAILURE, 0, "while inserting into DEST: %s",
+                  error_.message);
 
-    rbh_iter_destroy(convert->fsentries);
-    free(convert);
-}
+        if (bulk_link_document(links, documents[index]))
+            updates++;
+    }
+    bson_destroy(&reply);
 
-static const struct rbh_iterator_operations CONVERT_ITER_OPS = {
-    .next = convert_iter_next,
-    .destroy = convert_iter_destroy,
-};
+    if (updates > 0 && !mongoc_bulk_operation_execute(links, &reply, &error_))
+        error(EXIT_FAILURE, 0, "while linking hardlinks in DEST: %s",
+              error_.message);
+    if (updates > 0)
+        bson_destroy(&reply);
+    mongoc_bulk_operation_destroy(links);
 
-static const struct rbh_iterator CONVERT_ITER = {
-    .ops = &CONVERT_ITER_OPS,
+out:
+    mongoc_bulk_operation_destroy(bulk);
+    bson_destroy(&opts);
+}
+
+struct index_list {
+    bson_t **indexes;
+    size_t count;
 };
 
-static struct rbh_iterator *
-iter_convert(struct rbh_iterator *fsentries,
-             const struct rbh_filter_projection *projection)
+/* Drop every secondary index of `collection', and return their definitions */
+static struct index_list
+drop_indexes(mongoc_collection_t *collection)
 {
-    struct convert_iterator *convert;
+    struct index_list list = {};
+    mongoc_cursor_t *cursor;
+    bson_error_t error_;
+    const bson_t *index;
 
-    convert = malloc(sizeof(*convert));
-    if (convert == NULL)
-        return NULL;
+    cursor = mongoc_collection_find_indexes_with_opts(collection, NULL);
+    while (mongoc_cursor_next(cursor, &index)) {
+        bson_iter_t name;
+        void *tmp;
 
-    convert->iterator = CONVERT_ITER;
-    convert->fsentries = fsentries;
-    convert->projection = projection;
-    convert->fsentry = NULL;
-    convert->todo.upsert = convert->todo.link = false;
-    convert->todo.inode_xattr = convert->todo.ns_xattr = false;
+        if (!bson_iter_init_find(&name, index, "name")
+         || strcmp(bson_iter_utf8(&name, NULL), "_id_") == 0)
+            continue;
 
-    return &convert->iterator;
+        tmp = reallocarray(list.indexes, list.count + 1,
+                           sizeof(*list.indexes));
+        if (tmp == NULL)
+            error(EXIT_FAILURE, errno, "reallocarray");
+        list.indexes = tmp;
+        list.indexes[list.count++] = bson_copy(index);
+    }
+
+    if (mongoc_cursor_error(cursor, &error_))
+        error(EXIT_FAILURE, 0, "while listing DEST's indexes: %s",
+              error_.message);
+    mongoc_cursor_destroy(cursor);
+
+    for (size_t i = 0; i < list.count; i++) {
+        bson_iter_t name;
+
+        bson_iter_init_find(&name, list.indexes[i], "name");
+        if (!mongoc_collection_drop_index(collection,
+                                          bson_iter_utf8(&name, NULL),
+                                          &error_))
+            error(EXIT_FAILURE, 0, "while dropping DEST's indexes: %s",
+                  error_.message);
+    }
+
+    return list;
 }
 
 static void
-sync(const struct rbh_filter_projection *projection)
+create_indexes(mongoc_collection_t *collection, struct index_list *list)
 {
-    const struct rbh_filter_options OPTIONS = {
-        .projection = {
-            .fsentry_mask = RBH_FP_ALL,
-            .statx_mask = RBH_STATX_ALL,
-        },
-    };
-    struct rbh_mut_iterator *_fsentries;
-    struct rbh_iterator *fsentries;
-    struct rbh_iterator *fsevents;
+    bson_t command, indexes, reply;
+    bson_error_t error_;
 
-    if (one) {
-        struct rbh_fsentry *root;
+    if (list->count == 0)
+        return;
 
-        root = rbh_backend_root(from, &OPTIONS.projection);
-        if (root == NULL)
-            error(EXIT_FAILURE, errno, "rbh_backend_root");
+    bson_init(&command);
+    BSON_APPEND_UTF8(&command, "createIndexes",
+                     mongoc_collection_get_name(collection));
+    BSON_APPEND_ARRAY_BEGIN(&command, "indexes", &indexes);
+    for (size_t i = 0; i < list->count; i++) {
+        char index[16];
 
-        _fsentries = mut_iter_one(root);
-        if (_fsentries == NULL)
-            error(EXIT_FAILURE, errno, "rbh_mut_array_iterator");
-    } else {
-        /* "Dump" `from' */
-        _fsentries = rbh_backend_filter(from, NULL, &OPTIONS);
-        if (_fsentries == NULL)
-            error(EXIT_FAILURE, errno, "rbh_backend_filter_fsentries");
+        snprintf(index, sizeof(index), "%zu", i);
+        BSON_APPEND_DOCUMENT(&indexes, index, list->indexes[i]);
+        bson_destroy(list->indexes[i]);
     }
+    bson_append_array_end(&command, &indexes);
+    free(list->indexes);
 
-    fsentries = rbh_iter_constify(_fsentries);
-    if (fsentries == NULL) {
-        int save_errno = errno;
+    if (!mongoc_collection_write_command_with_opts(collection, &command, NULL,
+                                                   &reply, &error_))
+        error(EXIT_FAILURE, 0, "while building DEST's indexes: %s",
+              error_.message);
 
-        rbh_mut_iter_destroy(_fsentries);
-        error(EXIT_FAILURE, save_errno, "rbh_iter_constify");
-    }
+    bson_destroy(&reply);
+    bson_destroy(&command);
+}
 
-    /* Convert all this information into fsevents */
-    fsevents = iter_convert(fsentries, projection);
-    if (fsevents == NULL) {
-        int save_errno = errno;
+static void
+sync_initial_load(const char *dest,
+                  const struct rbh_filter_projection *projection)
+{
+    bson_t *documents[RBH_ITER_CHUNK_SIZE];
+    struct scratch *scratch = NULL;
+    mongoc_collection_t *collection;
+    struct rbh_mut_iterator *fsentries;
+    struct rbh_fsentry *fsentry;
+    struct index_list indexes;
+    size_t count = 0;
+    bson_error_t error_;
+    struct rbh_uri *uri;
+    bson_t filter, opts;
+    int64_t existing;
 
-        rbh_iter_destroy(fsentries);
-        error(EXIT_FAILURE, save_errno, "iter_convert");
-    }
+    uri = uri_from_string(dest);
+    if (uri == NULL)
+        error(EXIT_FAILURE, errno, "cannot parse URI: %s", dest);
+    if (strcmp(uri->backend, "mongo") || uri->type != RBH_UT_BARE)
+        error(EX_USAGE, 0, "--initial-load requires a whole mongo DEST");
 
-    /* XXX: the mongo backend tries to process all the fsevents at once in a
-     *      single bulk operation, but a bulk operation is limited in size.
-     *
-     * Splitting `fsevents' into fixed-size sub-iterators solves this.
-     */
-    chunks = rbh_iter_chunkify(fsevents, RBH_ITER_CHUNK_SIZE);
-    if (chunks == NULL) {
-        int save_errno = errno;
+    collection = mongoc_client_get_collection(mongo_client(), uri->fsname,
+                                              "entries");
+    free(uri);
 
-        rbh_iter_destroy(fsevents);
-        error(EXIT_FAILURE, save_errno, "rbh_mut_iter_chunkify");
-    }
+    bson_init(&filter);
+    bson_init(&opts);
+    BSON_APPEND_INT64(&opts, "limit", 1);
+    existing = mongoc_collection_count_documents(collection, &filter, &opts,
+                                                 NULL, NULL, &error_);
+    bson_destroy(&opts);
+    bson_destroy(&filter);
+    if (existing < 0)
+        error(EXIT_FAILURE, 0, "while counting DEST's entries: %s",
+              error_.message);
+    if (existing > 0)
+        error(EX_USAGE, 0, "--initial-load requires an empty DEST");
 
-    /* Update `to' */
-    do {
-        struct rbh_iterator *chunk = rbh_mut_iter_next(chunks);
-        int save_errno;
-        ssize_t count;
+    indexes = drop_indexes(collection);
 
-        if (chunk == NULL) {
-            if (errno == ENODATA || errno == RBH_BACKEND_ERROR)
-                break;
-            error(EXIT_FAILURE, errno, "while chunkifying SOURCE's entries");
-        }
+    if (xattr_policy_enabled())
+        scratch = scratch_new();
 
-        count = rbh_backend_update(to, chunk);
-        save_errno = errno;
-        rbh_iter_destroy(chunk);
-        if (count < 0) {
-            errno = save_errno;
-            assert(errno != ENODATA);
-            break;
+    fsentries = source_fsentries(from, one);
+    while ((fsentry = rbh_mut_iter_next(fsentries)) != NULL) {
+        if (!(fsentry->mask & RBH_FP_ID)) {
+            free(fsentry);
+            continue;
         }
-    } while (true);
 
-    switch (errno) {
-    case ENODATA:
-        return;
-    case RBH_BACKEND_ERROR:
-        error(EXIT_FAILURE, 0, "unhandled error: %s", rbh_backend_error);
-        __builtin_unreachable();
-    default:
-        error(EXIT_FAILURE, errno, "while iterating over SOURCE's entries");
+        documents[count++] = bson_from_fsentry(fsentry, projection, scratch);
+        free(fsentry);
+
+        if (count < RBH_ITER_CHUNK_SIZE)
+            continue;
+
+        insert_documents(collection, documents, count);
+        while (count > 0)
+            bson_destroy(documents[--count]);
     }
+
+    if (errno != ENODATA)
+        error(EXIT_FAILURE, errno, "while iterating over SOURCE's entries");
+    rbh_mut_iter_destroy(fsentries);
+
+    if (count > 0)
+        insert_documents(collection, documents, count);
+    while (count > 0)
+        bson_destroy(documents[--count]);
+
+    create_indexes(collection, &indexes);
+    mongoc_collection_destroy(collection);
+    if (scratch)
+        scratch_destroy(scratch);
 }
 
+#endif
+
 /*----------------------------------------------------------------------------*
  |                                    cli                                     |
  *----------------------------------------------------------------------------*/
@@ -478,19 +4714,42 @@ static int
 usage(void)
 {
     const char *message =
-        "usage: %s [-ho] [-f [+-]FIELD] SOURCE DEST\n"
+        "usage: %s [-hioru] [-c FILE] [-d DURATION] [-f [+-]FIELD] [-j JOBS]\n"
+        "       [-x [NAME=]SIZE[:ACTION]] [-X NAME] SOURCE DEST\n"
         "\n"
         "Upsert SOURCE's entries into DEST\n"
         "\n"
         "Positional arguments:\n"
-        "    SOURCE  a robinhood URI\n"
-        "    DEST    a robinhood URI\n"
+        "    SOURCE  a robinhood URI, or - to read fsevents on stdin\n"
+        "    DEST    a robinhood URI, or - to write fsevents on stdout\n"
         "\n"
         "Optional arguments:\n"
+        "    -c,--coordinate FILE  share the sync with other processes, through\n"
+        "                          the work queue FILE\n"
+        "    -d,--deadline DURATION\n"
+        "                          sync the most recently modified subtrees\n"
+        "                          first, stop after DURATION (eg. 45s, 90m,\n"
+        "                          8h) and print the subtrees left stale\n"
         "    -f,--field [+-]FIELD  select, add or remove a FIELD to synchronize\n"
         "                          (can be specified multiple times)\n"
         "    -h,--help             show this message and exit\n"
+        "    -i,--initial-load     bulk load an empty mongo DEST, building its\n"
+        "                          indexes last (requires libmongoc)\n"
+        "    -j,--jobs JOBS        read a mongo SOURCE with up to JOBS\n"
+        "                          concurrent cursors (requires libmongoc)\n"
         "    -o,--one              only consider the root of SOURCE\n"
+        "    -r,--rescan           re-read the entries that changed during the\n"
+        "                          sync, until (almost) none did\n"
+        "    -u,--rollup           store the number of entries, size and blocks\n"
+        "                          under each directory, in its \""RBH_ROLLUP_XATTR"\"\n"
+        "                          namespace xattr\n"
+        "    -x,--xattr-max-size [NAME=]SIZE[:ACTION]\n"
+        "                          cap the size of xattr values (or only of\n"
+        "                          those named NAME, a shell pattern), ACTION\n"
+        "                          is what to do with larger ones: drop\n"
+        "                          (default), truncate or hash\n"
+        "    -X,--xattr-hash NAME  replace NAME's values above the cap (all of\n"
+        "                          them if there is none) with their hash\n"
         "\n"
         "A robinhood URI is built as follows:\n"
         "    "RBH_SCHEME":BACKEND:FSNAME[#{PATH|ID}]\n"
@@ -772,6 +5031,172 @@ str2field(const char *string_)
     __builtin_unreachable();
 }
 
+/* A number of seconds, optionally suffixed with a unit (s, m, h or d) */
+static time_t
+str2duration(const char *string)
+{
+    unsigned long value;
+    char *end;
+
+    errno = 0;
+    value = strtoul(string, &end, 10);
+    if (errno || *string == '-' || end == string)
+        goto invalid;
+
+    switch (*end) {
+    case 'd':
+        value *= 24;
+        /* Fallthrough */
+    case 'h':
+        value *= 60;
+        /* Fallthrough */
+    case 'm':
+        value *= 60;
+        /* Fallthrough */
+    case 's':
+        end++;
+        break;
+    }
+
+    if (*end != '\0' || value == 0)
+        goto invalid;
+    return value;
+
+invalid:
+    error(EX_USAGE, 0, "invalid duration: %s", string);
+    __builtin_unreachable();
+}
+
+/* A number of bytes, optionally suffixed with a unit (k, M or G) */
+static size_t
+str2size(const char *string)
+{
+    unsigned long long value;
+    char *end;
+
+    errno = 0;
+    value = strtoull(string, &end, 10);
+    if (errno || *string == '-' || end == string)
+        goto invalid;
+
+    switch (*end) {
+    case 'G':
+        value <<= 10;
+        /* Fallthrough */
+    case 'M':
+        value <<= 10;
+        /* Fallthrough */
+    case 'k':
+        value <<= 10;
+        end++;
+        break;
+    }
+
+    if (*end != '\0' || value >= SIZE_MAX)
+        goto invalid;
+    return value;
+
+invalid:
+    error(EX_USAGE, 0, "invalid size: %s", string);
+    __builtin_unreachable();
+}
+
+static enum xattr_action
+str2xattr_action(const char *string)
+{
+    for (enum xattr_action action = 0; action < XA_COUNT; action++) {
+        if (strcmp(string, XATTR_ACTIONS[action]) == 0)
+            return action;
+    }
+
+    error(EX_USAGE, 0, "invalid xattr action: %s", string);
+    __builtin_unreachable();
+}
+
+/* The rule for `pattern' (the default one if NULL), created if need be */
+static struct xattr_rule *
+xattr_policy_rule(const char *pattern)
+{
+    struct xattr_rule *rules;
+
+    if (pattern == NULL)
+        return &xattr_policy.fallback;
+
+    for (size_t i = 0; i < xattr_policy.count; i++) {
+        if (strcmp(xattr_policy.rules[i].pattern, pattern) == 0)
+            return &xattr_policy.rules[i];
+    }
+
+    rules = reallocarray(xattr_policy.rules, xattr_policy.count + 1,
+                         sizeof(*rules));
+    if (rules == NULL)
+        error(EXIT_FAILURE, errno, "reallocarray");
+    xattr_policy.rules = rules;
+
+    rules[xattr_policy.count].pattern = pattern;
+    rules[xattr_policy.count].max_size = SIZE_MAX;
+    rules[xattr_policy.count].action = XA_DROP;
+    return &rules[xattr_policy.count++];
+}
+
+/* Parse [NAME=]SIZE[:ACTION] */
+static void
+xattr_policy_set_max_size(char *string)
+{
+    const char *pattern = NULL;
+    struct xattr_rule *rule;
+    char *equal, *colon;
+
+    equal = strrchr(string, '=');
+    if (equal) {
+        *equal = '\0';
+        pattern = string;
+        string = equal + 1;
+    }
+    rule = xattr_policy_rule(pattern);
+
+    colon = strchr(string, ':');
+    if (colon) {
+        *colon = '\0';
+        rule->action = str2xattr_action(colon + 1);
+    }
+    rule->max_size = str2size(string);
+}
+
+static void
+xattr_policy_set_hash(const char *pattern)
+{
+    xattr_policy_rule(pattern)->action = XA_HASH;
+}
+
+/* Rules without a cap of their own inherit the default one, if any */
+static void
+xattr_policy_resolve(void)
+{
+    const size_t max_size = xattr_policy.fallback.max_size;
+
+    for (size_t i = 0; i < xattr_policy.count; i++) {
+        struct xattr_rule *rule = &xattr_policy.rules[i];
+
+        if (rule->max_size == SIZE_MAX)
+            rule->max_size = max_size == SIZE_MAX ? 0 : max_size;
+    }
+}
+
+static size_t
+str2jobs(const char *string)
+{
+    unsigned long value;
+    char *end;
+
+    errno = 0;
+    value = strtoul(string, &end, 10);
+    if (errno || *string == '-' || *end != '\0' || value == 0)
+        error(EX_USAGE, 0, "invalid number of jobs: %s", string);
+
+    return value;
+}
+
 static void
 projection_add(struct rbh_filter_projection *projection,
                const struct rbh_filter_field *field)
@@ -853,6 +5278,16 @@ int
 main(int argc, char *argv[])
 {
     const struct option LONG_OPTIONS[] = {
+        {
+            .name = "coordinate",
+            .has_arg = required_argument,
+            .val = 'c',
+        },
+        {
+            .name = "deadline",
+            .has_arg = required_argument,
+            .val = 'd',
+        },
         {
             .name = "field",
             .has_arg = required_argument,
@@ -862,22 +5297,65 @@ main(int argc, char *argv[])
             .name = "help",
             .val = 'h',
         },
+        {
+            .name = "initial-load",
+            .val = 'i',
+        },
+        {
+            .name = "jobs",
+            .has_arg = required_argument,
+            .val = 'j',
+        },
         {
             .name = "one",
             .val = 'o',
         },
+        {
+            .name = "rescan",
+            .val = 'r',
+        },
+        {
+            .name = "rollup",
+            .val = 'u',
+        },
+        {
+            .name = "xattr-max-size",
+            .has_arg = required_argument,
+            .val = 'x',
+        },
+        {
+            .name = "xattr-hash",
+            .has_arg = required_argument,
+            .val = 'X',
+        },
         {}
     };
     struct rbh_filter_projection projection = {
         .fsentry_mask = RBH_FP_ALL,
         .statx_mask = RBH_STATX_ALL & ~RBH_STATX_MNT_ID,
     };
+    const char *coordinate = NULL;
+    bool initial_load = false;
+    bool stream_out;
+    bool stream_in;
+    bool fields = false;
+    bool rollup = false;
+    time_t duration = 0;
+    time_t start;
     char c;
 
     /* Parse the command line */
-    while ((c = getopt_long(argc, argv, "f:ho", LONG_OPTIONS, NULL)) != -1) {
+    while ((c = getopt_long(argc, argv, "c:d:f:hij:oruX:x:", LONG_OPTIONS,
+                            NULL)) != -1) {
         switch (c) {
+        case 'c':
+            coordinate = optarg;
+            break;
+        case 'd':
+            duration = str2duration(optarg);
+            break;
         case 'f':
+            fields = true;
             switch (optarg[0]) {
             case '+':
                 projection_add(&projection, str2field(optarg + 1));
@@ -893,9 +5371,27 @@ main(int argc, char *argv[])
         case 'h':
             usage();
             return 0;
+        case 'i':
+            initial_load = true;
+            break;
+        case 'j':
+            jobs = str2jobs(optarg);
+            break;
         case 'o':
             one = true;
             break;
+        case 'r':
+            rescan = true;
+            break;
+        case 'u':
+            rollup = true;
+            break;
+        case 'x':
+            xattr_policy_set_max_size(optarg);
+            break;
+        case 'X':
+            xattr_policy_set_hash(optarg);
+            break;
         case '?':
         default:
             /* getopt_long() prints meaningful error messages itself */
@@ -906,17 +5402,137 @@ main(int argc, char *argv[])
     argc -= optind;
     argv += optind;
 
+    xattr_policy_resolve();
+
     if (argc < 2)
         error(EX_USAGE, 0, "not enough arguments");
     if (argc > 2)
         error(EX_USAGE, 0, "unexpected argument: %s", argv[2]);
+    if (coordinate && one)
+        error(EX_USAGE, 0, "--coordinate and --one are mutually exclusive");
+    if (coordinate && rescan)
+        error(EX_USAGE, 0,
+              "--coordinate and --rescan are mutually exclusive");
+    if (coordinate && initial_load)
+        error(EX_USAGE, 0,
+              "--coordinate and --initial-load are mutually exclusive");
+    if (duration && (coordinate || one || rescan || initial_load))
+        error(EX_USAGE, 0, "--deadline is incompatible with --coordinate, "
+                           "--one, --rescan and --initial-load");
+    if (rollup && (coordinate || one || duration || initial_load))
+        error(EX_USAGE, 0, "--rollup is incompatible with --coordinate, "
+                           "--one, --deadline and --initial-load");
+    if (jobs > 1 && (coordinate || duration || initial_load || one || rollup))
+        error(EX_USAGE, 0, "--jobs is incompatible with --coordinate, "
+                           "--deadline, --initial-load, --one and --rollup");
+#ifndef HAVE_MONGOC
+    if (initial_load)
+        error(EX_USAGE, 0, "--initial-load requires libmongoc");
+    if (jobs > 1)
+        error(EX_USAGE, 0, "--jobs requires libmongoc");
+#endif
+
+    stream_in = strcmp(argv[0], "-") == 0;
+    stream_out = strcmp(argv[1], "-") == 0;
+    if (stream_in && stream_out)
+        error(EX_USAGE, 0, "SOURCE and DEST cannot both be -");
+    if ((stream_in || stream_out)
+     && (coordinate || duration || initial_load || jobs > 1 || rollup))
+        error(EX_USAGE, 0, "streams are incompatible with --coordinate, "
+                           "--deadline, --initial-load, --jobs and --rollup");
+    if (stream_in && (fields || one || rescan || xattr_policy_enabled()))
+        error(EX_USAGE, 0, "--field, --one, --rescan and the xattr options "
+                           "apply to the process that writes the stream");
+    if (jobs > 1 && !is_whole_mongo_backend(argv[0]))
+        error(EX_USAGE, 0, "--jobs requires SOURCE to be a whole mongo "
+                           "backend");
+
+    /* Backends which cannot filter (all but mongo) are rescanned by walking
+     * SOURCE's FSNAME
+     */
+    if (rescan && !one) {
+        struct rbh_uri *uri = uri_from_string(argv[0]);
+
+        if (uri == NULL)
+            error(EXIT_FAILURE, errno, "cannot parse URI: %s", argv[0]);
+        if (strcmp(uri->backend, "mongo"))
+            local_tree_check(uri, "--rescan");
+        free(uri);
+    }
+
+    if (stream_in) {
+        to = rbh_backend_from_uri(argv[1]);
+        update_backend(to, iter_stream(stdin));
+        return EXIT_SUCCESS;
+    }
+
+    /* Only read from SOURCE what is synced, and what rbh-sync needs */
+    source_options.projection = projection;
+    if (rollup) {
+        source_options.projection.fsentry_mask |=
+            RBH_FP_ID | RBH_FP_PARENT_ID | RBH_FP_NAME | RBH_FP_STATX;
+        source_options.projection.statx_mask |=
+            RBH_STATX_TYPE | RBH_STATX_SIZE | RBH_STATX_BLOCKS;
+    }
+    if (rescan) {
+        source_options.projection.fsentry_mask |= RBH_FP_STATX;
+        source_options.projection.statx_mask |= RBH_STATX_CTIME_SEC;
+    }
 
     /* Parse SOURCE */
     from = rbh_backend_from_uri(argv[0]);
     /* Parse DEST */
-    to = rbh_backend_from_uri(argv[1]);
+    if (stream_out) {
+        output = stdout;
+        stream_start(output);
+    } else {
+        to = rbh_backend_from_uri(argv[1]);
+    }
+
+    if (coordinate) {
+        sync_coordinated(coordinate, argv[0], &projection);
+        xattr_policy_report();
+        return EXIT_SUCCESS;
+    }
+
+    start = time(NULL);
+
+    if (duration) {
+        bool complete;
+
+        deadline = start + duration;
+        complete = sync_prioritized(argv[0], &projection);
+        xattr_policy_report();
+        return complete ? EXIT_SUCCESS : EX_TEMPFAIL;
+    }
+
+#ifdef HAVE_MONGOC
+    if (initial_load)
+        sync_initial_load(argv[1], &projection);
+    else if (rollup)
+        sync_rollup(&projection);
+    else if (output)
+        sync_backends(&projection);
+    else if (jobs > 1) {
+        /* Asking for threads means not leaving the sync to the server */
+        if (!sync_parallel(argv[0], argv[1], &projection))
+            sync_backends(&projection);
+    } else if (!sync_server_side(argv[0], argv[1], &projection))
+        sync_backends(&projection);
+    destroy_client();
+#else
+    if (rollup)
+        sync_rollup(&projection);
+    else
+        sync_backends(&projection);
+#endif
+
+    if (rescan)
+        sync_rescan(argv[0], start, &projection);
 
-    sync(&projection);
+    if (output)
+        stream_end(output);
 
+    xattr_policy_report();
     return EXIT_SUCCESS;
 }
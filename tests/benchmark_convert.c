@@ -0,0 +1,174 @@
+/* This file is part of rbh-sync.
+ * Copyright (C) 2026 Commissariat a l'energie atomique et aux energies
+ *                    alternatives
+ *
+ * SPDX-License-Identifer: LGPL-3.0-or-later
+ */
+
+/* Conversion benchmark: feeds generated fsentries through iter_convert(),
+ * without any backend, and prints the throughput of the conversion along with
+ * a checksum of the fsevents it yields (which must not change when the
+ * conversion is optimized).
+ *
+ * It is not part of the meson build, compile and run it by hand:
+ *
+ *     cc -O2 -D_GNU_SOURCE -o benchmark_convert tests/benchmark_convert.c \
+ *         $(pkg-config --cflags --libs robinhood) -lpthread
+ *     ./benchmark_convert [COUNT [STATX_MASK]]
+ *
+ * COUNT defaults to 10^7 fsentries. STATX_MASK is the mask of the generated
+ * statx. It defaults to that of the projection, as rbh-sync reads SOURCE with
+ * it: RBH_STATX_ALL & ~RBH_STATX_MNT_ID. With RBH_STATX_ALL, the mount id must
+ * be masked out of every statx.
+ */
+
+#define main rbh_sync_main
+#include "../rbh-sync.c"
+#undef main
+
+/* Number of distinct fsentries generated (and then repeated) */
+#define TEMPLATES 4096
+
+struct template {
+    struct rbh_fsentry fsentry;
+    struct rbh_statx statx;
+    char data[64];
+};
+
+static struct template *templates;
+
+/* Like a backend would, return a copy of a template in a single allocation */
+struct generator {
+    struct rbh_mut_iterator iterator;
+    size_t count;
+    size_t index;
+};
+
+static void *
+generator_next(void *iterator)
+{
+    struct generator *generator = iterator;
+    const struct template *template;
+    struct template *copy;
+    ptrdiff_t shift;
+
+    if (generator->index == generator->count) {
+        errno = ENODATA;
+        return NULL;
+    }
+
+    template = &templates[generator->index++ % TEMPLATES];
+    copy = malloc(sizeof(*copy));
+    if (copy == NULL)
+        error(EXIT_FAILURE, errno, "malloc");
+
+    *copy = *template;
+    shift = (char *)copy - (char *)template;
+    copy->fsentry.id.data += shift;
+    copy->fsentry.parent_id.data += shift;
+    copy->fsentry.name += shift;
+    copy->fsentry.statx = &copy->statx;
+    return &copy->fsentry;
+}
+
+static void
+generator_destroy(void *iterator)
+{
+    free(iterator);
+}
+
+static const struct rbh_mut_iterator_operations GENERATOR_OPS = {
+    .next = generator_next,
+    .destroy = generator_destroy,
+};
+
+static void
+templates_init(uint32_t statx_mask)
+{
+    templates = calloc(TEMPLATES, sizeof(*templates));
+    if (templates == NULL)
+        error(EXIT_FAILURE, errno, "calloc");
+
+    for (size_t i = 0; i < TEMPLATES; i++) {
+        struct template *template = &templates[i];
+        struct rbh_fsentry *fsentry = &template->fsentry;
+        uint64_t id = i, parent = i / 16;
+
+        memcpy(template->data, &id, sizeof(id));
+        memcpy(template->data + 16, &parent, sizeof(parent));
+        snprintf(template->data + 32, 32, "file%zu", i);
+
+        /* A few fsentries lack some information */
+        fsentry->mask = RBH_FP_ALL;
+        if (i % 7 == 0)
+            fsentry->mask = RBH_FP_ID | RBH_FP_STATX;
+        if (i % 13 == 0)
+            fsentry->mask &= ~RBH_FP_ID;
+
+        fsentry->id.data = template->data;
+        fsentry->id.size = 16;
+        fsentry->parent_id.data = template->data + 16;
+        fsentry->parent_id.size = 16;
+        fsentry->name = template->data + 32;
+        template->statx.stx_mask = statx_mask;
+        template->statx.stx_size = i;
+        fsentry->statx = &template->statx;
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    const struct rbh_filter_projection projection = {
+        .fsentry_mask = RBH_FP_ALL,
+        .statx_mask = RBH_STATX_ALL & ~RBH_STATX_MNT_ID,
+    };
+    size_t count = argc > 1 ? strtoull(argv[1], NULL, 0) : 10000000;
+    uint32_t mask = argc > 2 ? strtoul(argv[2], NULL, 0)
+                             : projection.statx_mask;
+    const struct rbh_fsevent *fsevent;
+    struct generator *generator;
+    struct rbh_iterator *fsevents;
+    struct timespec start, end;
+    uint64_t checksum = 0;
+    size_t converted = 0;
+    double seconds;
+
+    templates_init(mask);
+
+    generator = malloc(sizeof(*generator));
+    if (generator == NULL)
+        error(EXIT_FAILURE, errno, "malloc");
+    generator->iterator.ops = &GENERATOR_OPS;
+    generator->count = count;
+    generator->index = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    fsevents = iter_convert(&generator->iterator, &projection);
+    if (fsevents == NULL)
+        error(EXIT_FAILURE, errno, "iter_convert");
+
+    while ((fsevent = rbh_iter_next(fsevents)) != NULL) {
+        uint64_t id;
+
+        memcpy(&id, fsevent->id.data, sizeof(id));
+        checksum = checksum * 31 + fsevent->type * 1000003 + id;
+        if (fsevent->type == RBH_FET_UPSERT && fsevent->upsert.statx)
+            checksum += fsevent->upsert.statx->stx_mask
+                      + fsevent->upsert.statx->stx_size;
+        converted++;
+    }
+    if (errno != ENODATA)
+        error(EXIT_FAILURE, errno, "rbh_iter_next");
+    rbh_iter_destroy(fsevents);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    seconds = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    printf("%zu fsentries -> %zu fsevents in %.3fs (%.0f fsentries/s), "
+           "checksum %016" PRIx64 "\n", count, converted, seconds,
+           count / seconds, checksum);
+    free(templates);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,270 @@
+#!/usr/bin/env bash
+
+# This file is part of rbh-sync.
+# Copyright (C) 2026 Commissariat a l'energie atomique et aux energies
+#                    alternatives
+#
+# SPDX-License-Identifer: LGPL-3.0-or-later
+
+# Scaling benchmark of rbh-sync against a local mongod, configured through the
+# RBH_BENCH_* environment variables below. It is not part of the meson test
+# suite, run it directly from the build directory (where rbh-sync was built):
+#
+#     RBH_BENCH_SIZES="10000 1000000" ../tests/benchmark_sync_scaling.bash
+#
+# To catch regressions, keep the results of a reference run and point
+# RBH_BENCH_BASELINE to them.
+
+set -e
+
+################################################################################
+#                                CONFIGURATION                                 #
+################################################################################
+
+# Number of entries of each generated tree (10^4 to 10^7 is a sensible range)
+sizes=(${RBH_BENCH_SIZES:-10000 100000})
+# Shapes of the generated trees (see the GENERATORS section below)
+shapes=(${RBH_BENCH_SHAPES:-deep wide xattrs hardlinks})
+# Flows to benchmark
+flows=(${RBH_BENCH_FLOWS:-posix-mongo mongo-mongo})
+
+# Where to append results (one line per run, tab separated)
+results=${RBH_BENCH_RESULTS:-$PWD/benchmark_sync_scaling.tsv}
+# A previous results file to compare against (optional)
+baseline=${RBH_BENCH_BASELINE:+$(readlink -f "$RBH_BENCH_BASELINE")}
+# Tolerated throughput loss against `baseline', in percent
+threshold=${RBH_BENCH_THRESHOLD:-10}
+
+################################################################################
+#                                  UTILITIES                                   #
+################################################################################
+
+SUITE=${BASH_SOURCE##*/}
+SUITE=${SUITE%.*}
+
+__rbh_sync=$(PATH="$PWD:$PATH" which rbh-sync)
+
+__mongo=$(which mongosh || which mongo)
+mongo()
+{
+    "$__mongo" --quiet "$@"
+}
+
+__time=$(which time || true)
+
+error()
+{
+    printf "$@" >&2
+    exit 1
+}
+
+# Number of documents written (inserted or updated) by mongod so far
+mongo_writes()
+{
+    mongo admin --eval '
+        const opcounters = db.serverStatus().opcounters;
+        print(Number(opcounters.insert) + Number(opcounters.update));
+    '
+}
+
+# Print `count' file names on stdout, one per line
+names()
+{
+    local prefix="$1"
+    local count="$2"
+
+    awk -v prefix="$prefix" -v count="$count" \
+        'BEGIN { for (i = 0; i < count; i++) printf "%s%d\n", prefix, i }'
+}
+
+################################################################################
+#                                  GENERATORS                                  #
+################################################################################
+
+# Each generator populates the current directory with about `$1' entries
+
+# Chains of 256 nested directories, each level holding 9 files
+generate_deep()
+{
+    local chains=$((($1 + 2559) / 2560))
+
+    for ((chain = 0; chain < chains; chain++)); do
+        mkdir -p chain$chain$(printf '/d%.0s' {1..255})
+    done
+
+    awk -v chains=$chains 'BEGIN {
+        for (chain = 0; chain < chains; chain++) {
+            path = "chain" chain
+            for (level = 0; level < 256; level++) {
+                for (file = 0; file < 9; file++)
+                    printf "%s/f%d\n", path, file
+                path = path "/d"
+            }
+        }
+    }' | xargs touch
+}
+
+# `$1' files spread in flat directories of up to `$2' files each
+generate_flat()
+{
+    local remaining=$1
+
+    for ((dir = 0; remaining > 0; dir++)); do
+        local count=$((remaining < $2 ? remaining : $2))
+
+        mkdir "dir$dir"
+        (cd "dir$dir" && names f $count | xargs touch)
+        remaining=$((remaining - count))
+    done
+}
+
+generate_wide()
+{
+    generate_flat $1 100000
+}
+
+# Each file holds 4 user xattrs of 64, 128, 256 and 512 bytes
+generate_xattrs()
+{
+    generate_flat $1 10000
+
+    find . -type f -printf '%P\n' | awk '
+        BEGIN {
+            value = "0x"
+            for (i = 0; i < 512; i++)
+                value = value "ab"
+        }
+        {
+            printf "# file: %s\n", $0
+            for (i = 0; i < 4; i++)
+                printf "user.bench%d=%s\n", i, substr(value, 1, 2 + 128 * 2 ^ i)
+            printf "\n"
+        }' | setfattr --restore=-
+}
+
+# Half of the entries are hardlinks to the other half
+generate_hardlinks()
+{
+    mkdir inodes
+    (cd inodes && generate_flat $(($1 / 2)) 10000)
+    cp -al inodes links
+}
+
+################################################################################
+#                                  BENCHMARK                                   #
+################################################################################
+
+# Run rbh-sync, then print "<seconds> <max RSS in kB> <writes>"
+measure()
+{
+    local output=$(mktemp)
+    local writes=$(mongo_writes)
+
+    "$__time" --format '%e %M' --output "$output" "$__rbh_sync" "$@" ||
+        error "rbh-sync %s failed\n" "$*"
+    writes=$(($(mongo_writes) - writes))
+
+    echo "$(< "$output") $writes"
+    rm "$output"
+}
+
+# Compare the results of one run with its counterpart in `baseline'
+check_regression()
+{
+    local flow=$1 shape=$2 size=$3 rate=$4
+
+    [ -n "$baseline" ] || return 0
+
+    awk -F '\t' -v flow=$flow -v shape=$shape -v size=$size -v rate=$rate \
+        -v threshold=$threshold '
+        $1 == flow && $2 == shape && $3 == size { reference = $6 }
+        END {
+            if (!reference)
+                exit 0
+            if (rate < reference * (100 - threshold) / 100) {
+                printf "%s/%s/%s: %.0f entries/s, baseline is %.0f\n",
+                       flow, shape, size, rate, reference > "/dev/stderr"
+                exit 1
+            }
+        }' "$baseline"
+}
+
+benchmark()
+{
+    local shape=$1 size=$2
+    local db1=$SUITE-1$shape$size
+    local db2=$SUITE-2$shape$size
+    local fail=0
+
+    mkdir "$shape$size"
+    (cd "$shape$size" && generate_$shape $size)
+    local entries=$(find "$shape$size" | wc -l)
+
+    for flow in "${flows[@]}"; do
+        local source destination
+
+        case $flow in
+        posix-mongo)
+            source=rbh:posix:$shape$size
+            destination=rbh:mongo:$db1
+            ;;
+        mongo-mongo)
+            # Sync the posix tree first if it was not benchmarked
+            [[ " ${flows[*]} " == *" posix-mongo "* ]] ||
+                "$__rbh_sync" rbh:posix:$shape$size rbh:mongo:$db1
+            source=rbh:mongo:$db1
+            destination=rbh:mongo:$db2
+            ;;
+        *)
+            error "unknown flow: %s\n" "$flow"
+            ;;
+        esac
+
+        local measures seconds rss writes
+        measures=$(measure "$source" "$destination") || return 1
+        read seconds rss writes <<< "$measures"
+
+        local rate=$(awk -v e=$entries -v s=$seconds \
+                         'BEGIN { printf "%.1f", e / (s > 0 ? s : 0.01) }')
+
+        # Before appending this run, in case `baseline' is `results'
+        local regressed=0
+        check_regression $flow $shape $size $rate || regressed=1
+
+        printf '%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n' $flow $shape $size \
+            $entries $seconds $rate $rss $writes | tee -a "$results"
+
+        [ $regressed -eq 0 ] || fail=1
+    done
+
+    mongo "$db1" --eval "db.dropDatabase()" >/dev/null
+    mongo "$db2" --eval "db.dropDatabase()" >/dev/null
+    rm -rf "$shape$size"
+
+    return $fail
+}
+
+################################################################################
+#                                     MAIN                                     #
+################################################################################
+
+[ -n "$__time" ] || error "GNU time is required to measure peak RSS\n"
+mongo --eval "db.runCommand({ping: 1})" >/dev/null ||
+    error "cannot reach mongod\n"
+
+[ -s "$results" ] ||
+    printf 'flow\tshape\tsize\tentries\tseconds\tentries/s\tmax-rss-kB\twrites\n' \
+        > "$results"
+
+tmpdir=$(mktemp --directory)
+trap -- "rm -rf '$tmpdir'" EXIT
+cd "$tmpdir"
+
+fail=0
+for size in "${sizes[@]}"; do
+    for shape in "${shapes[@]}"; do
+        benchmark $shape $size || fail=1
+    done
+done
+
+exit $fail
@@ -141,11 +141,53 @@ test_sync_branch()
     verify_databases_after_sync '{ "ns.xattrs.path": { $regex: "^/dir" }}'
 }
 
+test_sync_ns_xattrs()
+{
+    touch fileA
+    mkdir dir
+    touch dir/fileB
+    ln dir/fileB fileC
+
+    rbh_sync "rbh:posix:." "rbh:mongo:$testdb1"
+    # Without any option, whole mongo backends are synced server-side
+    rbh_sync "rbh:mongo:$testdb1" "rbh:mongo:$testdb2"
+
+    # Update the namespace xattrs of every link, then sync again
+    mongosh "$testdb1" --eval '
+        db.entries.updateMany({ns: {$exists: true}},
+                              {$set: {"ns.$[].xattrs.tag": "updated"}})
+    ' >/dev/null
+    rbh_sync "rbh:mongo:$testdb1" "rbh:mongo:$testdb2"
+
+    # The outdated links must have been replaced, not kept alongside
+    local outdated=$(mongosh "$testdb2" --eval '
+        db.entries.countDocuments({
+            ns: {$elemMatch: {"xattrs.tag": {$ne: "updated"}}}
+        })
+    ')
+    [ "$outdated" -eq 0 ] ||
+        error "%s entries kept links with outdated xattrs\n" "$outdated"
+
+    verify_databases_after_sync ''
+}
+
+test_sync_jobs()
+{
+    mkdir -p {1..9}/{1..9}
+    touch {1..9}/{1..9}/file
+
+    rbh_sync "rbh:posix:." "rbh:mongo:$testdb1"
+    rbh_sync --jobs 4 "rbh:mongo:$testdb1" "rbh:mongo:$testdb2"
+
+    verify_databases_after_sync ''
+}
+
 ################################################################################
 #                                     MAIN                                     #
 ################################################################################
 
-declare -a tests=(test_sync_simple test_sync_branch)
+declare -a tests=(test_sync_simple test_sync_branch test_sync_ns_xattrs
+                  test_sync_jobs)
 
 tmpdir=$(mktemp --directory)
 trap -- "rm -rf '$tmpdir'" EXIT
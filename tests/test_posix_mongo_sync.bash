@@ -81,6 +81,210 @@ test_sync_large_tree()
     done
 }
 
+test_sync_coordinate()
+{
+    local queue=$(mktemp)
+    local pids=()
+
+    mkdir -p {1..3}/{1..3}
+    truncate -s 1k "fileA" "1/fileB" "1/1/fileC"
+
+    for i in {1..3}; do
+        rbh_sync --coordinate "$queue" "rbh:posix:." "rbh:mongo:$testdb" &
+        pids+=($!)
+    done
+    for pid in "${pids[@]}"; do
+        wait $pid
+    done
+    rm "$queue"
+
+    find_attribute '"ns.xattrs.path":"/"'
+    for i in $(find *); do
+        find_attribute '"ns.xattrs.path":"/'$i'"'
+    done
+}
+
+test_sync_coordinate_removed()
+{
+    local queue=$(mktemp)
+
+    mkdir -p "dir" "gone/sub"
+    truncate -s 1k "fileA" "dir/fileB" "gone/fileC"
+
+    # As if the root had been split, and "gone" removed before being claimed
+    cat > "$queue" << EOF
+done 0 - tree .
+todo 0 - one .
+todo 0 - tree dir
+todo 0 - one gone
+todo 0 - tree gone
+EOF
+    rm -r "gone"
+
+    rbh_sync --coordinate "$queue" "rbh:posix:." "rbh:mongo:$testdb"
+
+    if grep --quiet --invert-match '^done ' "$queue"; then
+        error "work items left undone: $(grep --invert-match '^done ' "$queue")"
+    fi
+    rm "$queue"
+
+    find_attribute '"ns.xattrs.path":"/fileA"'
+    find_attribute '"ns.xattrs.path":"/dir/fileB"'
+}
+
+test_sync_rescan()
+{
+    truncate -s 1k "fileA"
+    mkdir "dir"
+    truncate -s 1k "dir/fileB"
+
+    rbh_sync --rescan "rbh:posix:." "rbh:mongo:$testdb"
+    find_attribute '"ns.xattrs.path":"/fileA"'
+    find_attribute '"ns.xattrs.path":"/dir/fileB"'
+}
+
+test_sync_rescan_changed()
+{
+    local stream=$(mktemp)
+    local fresh stale
+
+    mkdir -p "a/b" "c"
+    touch "a/stale-entry" "c/stale-entry"
+    # Make everything older than the start of the sync (minus RBH_RESCAN_SLACK)
+    sleep 3
+    # Only changes a/b, neither its parent nor the root
+    touch "a/b/fresh-entry"
+
+    rbh_sync --rescan "rbh:posix:." - > "$stream"
+    rbh_sync - "rbh:mongo:$testdb" < "$stream"
+
+    # Every entry is read once, and the rescan reads a/b's entries again (an
+    # entry's path is in the stream once per read)
+    fresh=$(grep --only-matching --text "/a/b/fresh-entry" "$stream" | wc -l)
+    stale=$(grep --only-matching --text "/a/stale-entry" "$stream" | wc -l)
+    rm "$stream"
+    [ $stale -gt 0 ] && [ $fresh -eq $((2 * stale)) ] ||
+        error "a/b/fresh-entry read $fresh times, a/stale-entry $stale times"
+
+    find_attribute '"ns.xattrs.path":"/a/b/fresh-entry"'
+}
+
+test_sync_initial_load()
+{
+    truncate -s 1k "fileA"
+    ln "fileA" "link"
+    mkdir "dir"
+    setfattr -n user.a -v b "dir"
+
+    rbh_sync --initial-load "rbh:posix:." "rbh:mongo:$testdb"
+    find_attribute '"ns.xattrs.path":"/"'
+    find_attribute '"ns.xattrs.path" : { $all : ["/fileA", "/link"] }'
+    find_attribute '"ns.xattrs.path":"/dir"' \
+                   '"xattrs.user.a" : { $exists : true }'
+}
+
+test_sync_deadline()
+{
+    mkdir -p {1..3}/{1..3}
+    truncate -s 1k "fileA" "1/fileB" "1/1/fileC"
+
+    local stale=$(rbh_sync --deadline 1h "rbh:posix:." "rbh:mongo:$testdb")
+    [ -z "$stale" ] || error "unexpected stale subtrees: $stale"
+
+    find_attribute '"ns.xattrs.path":"/"'
+    for i in $(find *); do
+        find_attribute '"ns.xattrs.path":"/'$i'"'
+    done
+}
+
+test_sync_deadline_reached()
+{
+    local stale rc=0
+
+    # Subtrees that each take several bulk operations to sync
+    for i in {1..16}; do
+        mkdir "$i"
+        (cd "$i" && touch file{1..4096})
+    done
+
+    stale=$(rbh_sync --deadline 1s "rbh:posix:." "rbh:mongo:$testdb") ||
+        rc=$?
+    [ $rc -eq 75 ] || error "exit status: expected 75 (EX_TEMPFAIL), got $rc"
+    [ -n "$stale" ] || error "no stale subtree was printed"
+
+    # The deadline may pass before even the root is synced
+    [ "$stale" != "rbh:posix:." ] || return 0
+
+    find_attribute '"ns.xattrs.path":"/"'
+    for i in {1..16}; do
+        if grep --quiet --line-regexp --fixed-strings "rbh:posix:.#$i" \
+                <<< "$stale"; then
+            continue
+        fi
+        find_attribute '"ns.xattrs.path":"/'$i'"'
+        find_attribute '"ns.xattrs.path":"/'$i'/file4096"'
+    done
+
+    while read -r subtree; do
+        [[ "$subtree" =~ ^rbh:posix:\.#([0-9]+)$ ]] &&
+            ((${BASH_REMATCH[1]} >= 1 && ${BASH_REMATCH[1]} <= 16)) ||
+            error "unexpected stale subtree: $subtree"
+    done <<< "$stale"
+}
+
+test_sync_rollup()
+{
+    mkdir -p "dir/subdir"
+    truncate -s 1k "dir/fileA"
+    truncate -s 2k "dir/subdir/fileB"
+    local size=$(($(stat -c %s "dir/subdir") + 1024 + 2048))
+
+    rbh_sync --rollup "rbh:posix:." "rbh:mongo:$testdb"
+    find_attribute '"ns.xattrs.path":"/dir/subdir"' \
+                   '"ns.xattrs.rollup.entries" : 1' \
+                   '"ns.xattrs.rollup.size" : 2048'
+    find_attribute '"ns.xattrs.path":"/dir"' \
+                   '"ns.xattrs.rollup.entries" : 3' \
+                   '"ns.xattrs.rollup.size" : '$size
+    find_attribute '"ns.xattrs.path":"/"' '"ns.xattrs.rollup.entries" : 4'
+}
+
+test_sync_xattr_max_size()
+{
+    truncate -s 1k "fileA"
+    setfattr -n user.small -v b "fileA"
+    setfattr -n user.large -v "0x$(printf 'ab%.0s' {1..2048})" "fileA"
+    setfattr -n user.hashed -v "0x$(printf 'ab%.0s' {1..2048})" "fileA"
+
+    # A value dropped by the policy must also be removed from DEST
+    rbh_sync "rbh:posix:." "rbh:mongo:$testdb"
+    find_attribute '"ns.xattrs.path":"/fileA"' \
+                   '"xattrs.user.large" : { $exists : true }'
+
+    rbh_sync --xattr-max-size 1k --xattr-hash user.hashed \
+        "rbh:posix:." "rbh:mongo:$testdb"
+    find_attribute '"ns.xattrs.path":"/fileA"' \
+                   '"xattrs.user.small" : { $exists : true }' \
+                   '"xattrs.user.large" : { $exists : false }' \
+                   '"xattrs.user.hashed.size" : 2048'
+}
+
+test_sync_stream()
+{
+    truncate -s 1k "fileA"
+    setfattr -n user.a -v b "fileA"
+    ln -s "fileA" "symlink"
+    mkdir "dir"
+    local length=$(stat -c %s "fileA")
+
+    rbh_sync "rbh:posix:." - | rbh_sync - "rbh:mongo:$testdb"
+    find_attribute '"ns.xattrs.path":"/"'
+    find_attribute '"ns.xattrs.path":"/fileA"' '"statx.size" : '$length \
+                   '"xattrs.user.a" : { $exists : true }'
+    find_attribute '"ns.xattrs.path":"/symlink"' '"symlink" : "fileA"'
+    find_attribute '"ns.xattrs.path":"/dir"'
+}
+
 test_sync_one_one_file()
 {
     truncate -s 1k "fileA"
@@ -151,6 +355,11 @@ test_sync_fifo()
 
 declare -a tests=(test_sync_2_files test_sync_size test_sync_3_files
                   test_sync_xattrs test_sync_subdir test_sync_large_tree
+                  test_sync_coordinate test_sync_coordinate_removed
+                  test_sync_rescan test_sync_rescan_changed
+                  test_sync_initial_load test_sync_deadline
+                  test_sync_deadline_reached test_sync_rollup
+                  test_sync_xattr_max_size test_sync_stream
                   test_sync_one_one_file test_sync_one_two_files
                   test_sync_socket test_sync_fifo)
 